@@ -0,0 +1,61 @@
+#pragma once
+
+#include "chess/evaluate.h"
+#include "chess/position.h"
+#include "chess/span.h"
+
+#include <memory>
+#include <vector>
+
+namespace Chess {
+
+/**
+ * Statistics on a batch of positions analysed by a Batch_analyser
+ */
+struct Batch_stats {
+    std::size_t positions = 0;
+    u64 nodes = 0;  // Nodes in the completed iterations of every search
+    u64 time = 0;   // Milliseconds
+    double positions_per_second = 0.0;
+};
+
+/**
+ * For analysing large numbers of positions. A pool of worker threads is kept
+ * for the lifetime of the analyser, and each worker keeps its own
+ * transposition table from one position to the next, so nothing is set up per
+ * position. Positions are handed out to the workers one at a time, and each is
+ * searched by a single worker.
+ *
+ * An analyser may only be used by one thread at a time.
+ */
+class Batch_analyser {
+public:
+    /**
+     * Each worker has a transposition table of 2^tt_log_size nodes. If workers
+     * is zero, there is one for each hardware thread.
+     */
+    explicit Batch_analyser(int workers = 0, u8 tt_log_size = 16);
+    ~Batch_analyser();
+
+    Batch_analyser(const Batch_analyser&) = delete;
+    Batch_analyser& operator=(const Batch_analyser&) = delete;
+
+    /**
+     * Searches each position with the given options, and returns the
+     * recommendations in the same order as the positions. The limits apply to
+     * each position separately, and options.threads is ignored.
+     */
+    std::vector<Recommendation> analyse(Span<Position>, const Search_options& = {});
+
+    // Statistics on the last batch analysed
+    const Batch_stats& stats() const { return stats_; }
+
+    int workers() const;
+private:
+    struct Pool;
+
+    std::unique_ptr<Pool> pool_;
+    Batch_stats stats_;
+};
+
+}  // namespace Chess
@@ -9,6 +9,9 @@
 #include "chess/move.h"
 #include "chess/move_list.h"
 #include "chess/position.h"
+#include "chess/span.h"
 #include "chess/typedefs.h"
 #include "chess/evaluate.h"
+#include "chess/batch.h"
+#include "chess/engine.h"
 
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "chess/evaluate.h"
+#include "chess/position.h"
+#include "chess/transposition_table.h"
+
+#include <memory>
+#include <vector>
+
+namespace Chess {
+
+/**
+ * A search engine that keeps its state from one search to the next, for
+ * playing a game or analysing many related positions. It owns its search
+ * threads, a transposition table and the move ordering history learnt by each
+ * thread, all of which are made once, when the engine is. Between searches,
+ * the threads sleep, and the history is aged so that it is still useful for
+ * the next search.
+ *
+ * Searches run in the background: go() starts one and returns straight away,
+ * and the results are given to the Io object as the search goes on. An engine
+ * may only be used by one thread at a time.
+ */
+class Engine {
+public:
+    /**
+     * The engine searches with the given number of threads, whatever
+     * Search_options::threads says, and with a transposition table of
+     * 2^tt_log_size nodes
+     */
+    explicit Engine(int threads = 1, u8 tt_log_size = 22);
+    ~Engine();
+
+    Engine(const Engine&) = delete;
+    Engine& operator=(const Engine&) = delete;
+
+    /**
+     * Starts searching a position, first waiting for any search already going
+     * to finish. The Io object must last until the search has finished. Calls
+     * Io::go() on it, so that stop() can stop the search.
+     */
+    void go(Io&, const Position&, const Search_options& = {});
+
+    /**
+     * Stops the search going, and returns its results as wait() does
+     */
+    std::vector<Recommendation> stop();
+
+    /**
+     * Waits for the search going to finish by itself, and returns the
+     * recommendations made by the last search (see recommend_moves)
+     */
+    std::vector<Recommendation> wait();
+
+    /**
+     * Searches a position, waiting for the result
+     */
+    std::vector<Recommendation> search(const Position&, const Search_options& = {});
+
+    /**
+     * Forgets everything learnt in previous searches, such as at the start of
+     * a new game
+     */
+    void clear();
+
+    int threads() const;
+private:
+    struct State;
+
+    std::unique_ptr<State> state_;
+};
+
+}  // namespace Chess
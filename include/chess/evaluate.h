@@ -1,14 +1,53 @@
 #pragma once
 
+#include "chess/move_list.h"
 #include "chess/position.h"
 #include "chess/transposition_table.h"
 
 #include <atomic>
 #include <functional>
 #include <utility>
+#include <vector>
 
 namespace Chess {
 
+/**
+ * Statistics on the work done by a search so far, summed over all threads.
+ * Nodes in the quiescence search are included in the node count, and also
+ * counted separately as qnodes.
+ */
+struct Search_stats {
+    int depth = 0;     // The last depth completed
+    int seldepth = 0;  // The greatest ply reached, including quiescence search
+    u64 nodes = 0;
+    u64 qnodes = 0;
+    u64 time = 0;  // Milliseconds since the search started
+    u64 nps = 0;
+
+    u64 tt_probes = 0;
+    u64 tt_hits = 0;
+    u64 tt_writes = 0;
+
+    // Nodes of the main search in which a move failed high, and the number of
+    // those in which it was the first move searched
+    u64 beta_cutoffs = 0;
+    u64 first_move_cutoffs = 0;
+
+    double tt_hit_rate() const {
+        return tt_probes ? double(tt_hits) / tt_probes : 0.0;
+    }
+
+    // The proportion of nodes in the main search that failed high
+    double beta_cutoff_rate() const {
+        return nodes > qnodes ? double(beta_cutoffs) / (nodes - qnodes) : 0.0;
+    }
+
+    // The proportion of cutoffs made by the first move, a measure of move ordering
+    double first_move_cutoff_rate() const {
+        return beta_cutoffs ? double(first_move_cutoffs) / beta_cutoffs : 0.0;
+    }
+};
+
 /**
  * Object for communicating with an evaluation function
  */
@@ -27,6 +66,18 @@ struct Io {
 
     std::function<void(Move)> report_best_move = [](Move){};
     std::function<void(i16)>  report_score     = [](i16){};
+
+    /**
+     * Called by the main search thread after each iteration it completes, with
+     * the depth, the score, the principal variation (the line expected to be
+     * played, starting with the move recommended) and statistics. The
+     * principal variation is only valid for the duration of the call.
+     *
+     * When searching for several moves (see Search_options::multipv), it is
+     * called once for each move, best first.
+     */
+    std::function<void(int, i16, Move_span, const Search_stats&)> report_iteration =
+        [](int, i16, Move_span, const Search_stats&){};
 private:
     std::atomic<bool> stop_ = false;
 };
@@ -41,17 +92,62 @@ struct Recommendation {
     i16 score;
 };
 
+/**
+ * Options controlling how a search is carried out.
+ *
+ * The limits follow the UCI 'go' command, with times in milliseconds, and a
+ * value of zero meaning no limit. The search finishes when the first limit is
+ * reached, or when Io::stop() is called. If no limit is set at all, the search
+ * goes to default_depth.
+ *
+ * Given the time left on the clock, the search takes a share of it for this
+ * move, and only starts another iteration if it expects to finish it within
+ * that share. It may overrun the share, but will never take longer than the
+ * time left.
+ */
+struct Search_options {
+    static constexpr int default_depth = 9;
+
+    // Number of threads to search with. Any threads beyond the first are
+    // helpers, which share the transposition table with the main thread.
+    int threads = 1;
+
+    // Number of best moves to find, each with its own score and principal
+    // variation (see recommend_moves)
+    int multipv = 1;
+
+    int depth = 0;     // Maximum depth in plies
+    u64 nodes = 0;     // Maximum nodes, counted over all threads
+    int movetime = 0;  // Time for this move
+
+    int wtime = 0;  // Time left on white's clock
+    int btime = 0;  // Time left on black's clock
+    int winc  = 0;  // White's increment per move
+    int binc  = 0;  // Black's increment per move
+};
+
 /**
  * Main function for selecting a move, the output is given to the Io object
  * passed in. The transposition table passed in will be used and modified.
  */
-void recommend_move(const Io&, const Position&, Transposition_table&);
+void recommend_move(const Io&, const Position&, Transposition_table&,
+                    const Search_options& = {});
+
+/**
+ * Finds the best options.multipv moves, ordered from best to worst, or fewer
+ * if there aren't that many legal moves. Each iteration searches for the best
+ * move, then the best move besides that one, and so on. The best move and its
+ * score are also given to the Io object, as with recommend_move.
+ */
+std::vector<Recommendation> recommend_moves(const Io&, const Position&, Transposition_table&,
+                                            const Search_options&);
 
 /**
  * Convenience function for recommending a move without having to pass in an Io
  * object
  */
-inline Recommendation recommend_move(const Position& position, Transposition_table& tt)
+inline Recommendation recommend_move(const Position& position, Transposition_table& tt,
+                                     const Search_options& options = {})
 {
     Recommendation result;
 
@@ -59,11 +155,22 @@ inline Recommendation recommend_move(const Position& position, Transposition_tab
     io.report_best_move = [&result](Move m) { result.move = m; };
     io.report_score     = [&result](i16 s) { result.score = s; };
 
-    recommend_move(io, position, tt);
+    recommend_move(io, position, tt, options);
 
     return result;
 }
 
+/**
+ * Convenience function for finding several moves without having to pass in an
+ * Io object
+ */
+inline std::vector<Recommendation> recommend_moves(const Position& position,
+                                                   Transposition_table& tt,
+                                                   const Search_options& options)
+{
+    return recommend_moves(Io{}, position, tt, options);
+}
+
 /**
  * Convenience function to recommend a move without needing to pass in a
  * transposition table
@@ -9,7 +9,51 @@ namespace Chess {
 
 Move_list generate_moves(const Position&);
 
+/**
+ * Generates only the captures and promotions available, as a subset of what
+ * generate_moves would produce
+ */
+Move_list generate_captures(const Position&);
+
+/**
+ * Generates only the moves that generate_captures leaves out
+ */
+Move_list generate_quiet_moves(const Position&);
+
+/**
+ * The number of moves generate_moves would produce, found without generating
+ * them, by counting the target squares of each piece
+ */
+int count_legal_moves(const Position&);
+
 bool is_legal_move(Move, const Position&);
 
+/**
+ * Whether a move could be made by the player to move, if leaving their own king
+ * in check were allowed. This is much cheaper than is_legal_move, and is meant
+ * for moves from elsewhere, such as a transposition table, which need checking
+ * before they are made. Castles are checked in full.
+ */
+bool is_pseudo_legal_move(Move, const Position&);
+
+/**
+ * Whether the player to move is in check
+ */
+bool in_check(const Position&);
+
+/**
+ * Whether the given player is in check, whoever is to move. After making a
+ * pseudo-legal move, this tells whether it was legal.
+ */
+bool in_check(const Position&, Player);
+
+/**
+ * Static exchange evaluation of a capture: the material the side to move can
+ * expect to win (or lose, if negative) from the capture and the best series of
+ * recaptures that follows on the same square. Pins are not taken into account.
+ * The score places a value of 100 on a pawn.
+ */
+int static_exchange_evaluation(const Position&, Move);
+
 }
 
@@ -92,7 +92,7 @@ inline constexpr bool is_black(Square s) {
 }
 
 inline constexpr bool is_square_owned_by_player(Square s, Player p) {
-    return (*s & 0b00000001) == *p;
+    return s != Square::empty && (*s & 0b00000001) == *p;
 }
 
 inline constexpr Piece to_piece(Square s)
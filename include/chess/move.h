@@ -80,6 +80,10 @@ inline constexpr bool is_promotion(Move::Info i) {
     return *i & 0b00000100;
 }
 
+inline constexpr bool is_quiet(Move::Info i) {
+    return !is_capture(i) && !is_promotion(i);
+}
+
 inline constexpr Piece promotion_piece(Move::Info i) {
     return Piece((*i & 0b00000011) * 2);
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "chess/move.h"
+#include "chess/span.h"
 
 namespace Chess {
 
@@ -22,6 +23,13 @@ struct Move_list {
         return data_[i];
     }
 
+    Move* data() {
+        return data_;
+    }
+    const Move* data() const {
+        return data_;
+    }
+
     Move* begin() {
         return data_;
     }
@@ -76,5 +84,7 @@ private:
     std::size_t size_;
 };
 
+using Move_span = Span<Move>;
+
 }
 
@@ -29,23 +29,67 @@ struct Position {
     Player active_player = Player::white;
     int halfmove_clock = 0;
     int fullmove_number = 1;
+
+    // Zobrist hash of the position, set by from_fen and kept up to date as
+    // moves are made
+    u64 hash = 0;
+
+    // Material and piece-square score from white's point of view, where a pawn
+    // is worth 100. Set by from_fen and kept up to date as moves are made.
+    i16 score = 0;
 };
 
 /**
- * Produces the Zobrist hash of a position, see
+ * Produces the Zobrist hash of a position from scratch, see
  * https://en.wikipedia.org/wiki/Zobrist_hashing
+ * This should always agree with the hash stored in the position itself.
  */
 u64 zobrist_hash(const Position&);
 
+/**
+ * Produces the material and piece-square score of a position from scratch, by
+ * looking at every square. This should always agree with the score stored in
+ * the position itself.
+ */
+i16 piece_square_score(const Position&);
+
 std::string to_fen(const Position&);
 std::istream& operator>>(std::istream&, Position&);
 
 /**
  * Moves can be applied to positions, with the result being an entirely new
- * position. It may be more efficient to apply the move in place, but such a
- * strategy would necessitate a complex 'unapply' function.
+ * position. This is implemented in terms of make_move.
  */
 Position apply(Move, Position);
 
+/**
+ * The information lost when a move is made in place, which is needed to take
+ * the move back again.
+ */
+struct Undo_info {
+    Square captured = Square::empty;
+    Castle_rights castling[2] = {Castle_rights::none, Castle_rights::none};
+    Location en_passant_target = "a1";
+    int halfmove_clock = 0;
+    int fullmove_number = 1;
+    u64 hash = 0;
+};
+
+/**
+ * Applies a move to a position in place. The returned object must be passed to
+ * unmake_move (along with the same move) to restore the original position.
+ * Moves must be unmade in the reverse order to which they were made.
+ */
+Undo_info make_move(Position&, Move);
+void unmake_move(Position&, Move, const Undo_info&);
+
+/**
+ * Passes the turn to the other player without moving anything, as used by
+ * null move pruning in the search. This is never a legal move, and must not be
+ * made when the player to move is in check.
+ */
+Undo_info make_null_move(Position&);
+void unmake_null_move(Position&, const Undo_info&);
+
 }  // namespace Chess
 
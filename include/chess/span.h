@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <iterator>
+
+namespace Chess {
+
+/**
+ * A read-only view of a contiguous sequence of objects stored elsewhere, such
+ * as a std::vector, a Move_list or a plain array. Like a pointer, it is only
+ * valid for as long as the objects it refers to. This stands in for C++20's
+ * std::span.
+ */
+template <typename T>
+struct Span {
+    constexpr Span() = default;
+    constexpr Span(const T* data, std::size_t size)
+        : data_{data}, size_{size}
+    {}
+
+    template <typename Container>
+    constexpr Span(const Container& container)
+        : data_{std::data(container)}, size_{std::size(container)}
+    {}
+
+    constexpr const T& operator[](std::size_t i) const {
+        return data_[i];
+    }
+
+    constexpr const T* begin() const {
+        return data_;
+    }
+    constexpr const T* end() const {
+        return data_ + size_;
+    }
+
+    constexpr std::size_t size() const {
+        return size_;
+    }
+
+    constexpr bool empty() const {
+        return size_ == 0;
+    }
+private:
+    const T* data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+}
@@ -3,14 +3,19 @@
 #include "misc.h"
 #include "move.h"
 
+#include <algorithm>
+#include <atomic>
 #include <vector>
 
 namespace Chess {
 
+/**
+ * What a stored score says about the true score of the position
+ */
 enum class Node_type : u8 {
-    pv,
-    fail_high,
-    fail_low,
+    pv,         // The score is exact
+    fail_high,  // The score is a lower bound: a move was found that was too good
+    fail_low,   // The score is an upper bound: no move reached alpha
 };
 
 /**
@@ -19,10 +24,10 @@ enum class Node_type : u8 {
 struct Transposition_node {
     u64 key = 0;
     Move best_move;
-    u8 best_move_position = 0;
     i16 score = 0;
     u8 depth = 0;
     Node_type type = Node_type::pv;
+    u8 generation = 0;  // Set by the table when the node is stored
 
     constexpr explicit operator bool() const {
         return key != 0;
@@ -31,33 +36,164 @@ struct Transposition_node {
 
 static_assert(sizeof(Transposition_node) == 16);
 
+/**
+ * The packed form of a node. Everything except the key is packed into a single
+ * data word, and the key is stored XORed with that data word. The table may be
+ * read and written by several search threads at once without locking, so one
+ * thread may read an entry that is only half written by another. Such an entry
+ * fails to reproduce the key it is probed with, and so is ignored.
+ */
+struct Transposition_entry {
+    u64 key_xor_data = 0;
+    u64 data = 0;
+
+    static Transposition_entry pack(const Transposition_node& node) {
+        const u64 move = (u64(node.best_move.from()) << 10) | (u64(node.best_move.to()) << 4) |
+                         u64(*node.best_move.info());
+        const u64 data = move |
+                         (u64(u16(node.score))  << 16) |
+                         (u64(node.depth)       << 32) |
+                         (u64(node.type)        << 40) |
+                         (u64(node.generation)  << 48);
+        return {node.key ^ data, data};
+    }
+
+    Transposition_node unpack() const {
+        Transposition_node node;
+        node.key = key_xor_data ^ data;
+        node.best_move = Move(u8((data >> 10) & 0x3F), u8((data >> 4) & 0x3F),
+                              Move::Info(data & 0x0F));
+        node.score = i16(u16(data >> 16));
+        node.depth = u8(data >> 32);
+        node.type = Node_type(u8(data >> 40));
+        node.generation = u8(data >> 48);
+        return node;
+    }
+
+    u64 key() const { return key_xor_data ^ data; }
+};
+
+static_assert(sizeof(Transposition_entry) == 16);
+
+/**
+ * A place in the table that holds an entry. The two words are accessed
+ * atomically, but separately, with relaxed ordering. This makes concurrent
+ * access well defined without costing anything over plain loads and stores,
+ * and the XOR check catches entries made of two different writes.
+ */
+struct Transposition_slot {
+    std::atomic<u64> key_xor_data{0};
+    std::atomic<u64> data{0};
+
+    Transposition_entry load() const {
+        return {key_xor_data.load(std::memory_order_relaxed),
+                data.load(std::memory_order_relaxed)};
+    }
+
+    void store(const Transposition_entry& entry) {
+        key_xor_data.store(entry.key_xor_data, std::memory_order_relaxed);
+        data.store(entry.data, std::memory_order_relaxed);
+    }
+};
+
+static_assert(std::atomic<u64>::is_always_lock_free);
+static_assert(sizeof(Transposition_slot) == 16);
+
+/**
+ * Slots are grouped into clusters which each fill one cache line. A key may be
+ * stored in any slot of the cluster it maps to.
+ */
+struct alignas(64) Transposition_cluster {
+    static constexpr int size = 4;
+
+    Transposition_slot slots[size];
+};
+
+static_assert(sizeof(Transposition_cluster) == 64);
+
 /**
  * A transposition table stores information on positions already seen in the
  * search tree. It is effectively a hash map, using the Zobrist hash function.
+ * It may be shared between search threads (see Transposition_entry).
+ *
+ * When a cluster is full, the node replaced is the one of least value, where
+ * deeper nodes and nodes from the current search are worth more. Call
+ * new_search() before each search so that stale nodes get replaced first.
  */
 struct Transposition_table {
+    // The table holds 2^log_size nodes, and at least one cluster
     Transposition_table(u8 log_size = 26)
-        : nodes_(1 << log_size), mask_{0}
-    {
-        for (u8 i = 0; i < log_size; ++i) {
-            mask_ |= (1 << i);
+        : clusters_(std::size_t(1) << cluster_bits(log_size)),
+          mask_{(u64(1) << cluster_bits(log_size)) - 1}
+    {}
+
+    /**
+     * Returns the node stored for the key, or an empty node if there is none
+     */
+    Transposition_node probe(u64 key) const {
+        for (const auto& slot : this->cluster_of(key).slots) {
+            const auto entry = slot.load();
+            if (entry.key() == key) return entry.unpack();
         }
+        return {};
     }
 
-    Transposition_node& at(u64 key) {
-        return nodes_[this->index_of(key)];
+    void store(Transposition_node new_node) {
+        new_node.generation = generation_;
+
+        auto& slots = this->cluster_of(new_node.key).slots;
+
+        Transposition_slot* replace = &slots[0];
+        int replace_value = this->value_of(slots[0].load().unpack());
+        for (auto& slot : slots) {
+            const auto node = slot.load().unpack();
+            if (!node || node.key == new_node.key) {
+                replace = &slot;
+                break;
+            }
+            if (this->value_of(node) < replace_value) {
+                replace = &slot;
+                replace_value = this->value_of(node);
+            }
+        }
+
+        replace->store(Transposition_entry::pack(new_node));
     }
 
-    const Transposition_node& at(u64 key) const {
-        return nodes_[this->index_of(key)];
+    // Must not be called while other threads are using the table
+    void new_search() { ++generation_; }
+
+    // Empties the table. Must not be called while other threads are using it.
+    void clear() {
+        for (auto& cluster : clusters_) {
+            for (auto& slot : cluster.slots) slot.store({});
+        }
+        generation_ = 0;
     }
 private:
-    constexpr std::size_t index_of(u64 key) const {
-        return key & mask_;
+    // Each cluster holds 2^2 nodes
+    static constexpr int cluster_bits(u8 log_size) {
+        return log_size > 2 ? log_size - 2 : 0;
+    }
+
+    Transposition_cluster& cluster_of(u64 key) {
+        return clusters_[key & mask_];
     }
 
-    std::vector<Transposition_node> nodes_;
+    const Transposition_cluster& cluster_of(u64 key) const {
+        return clusters_[key & mask_];
+    }
+
+    // The generation counts searches modulo 256, so the age is taken modulo 256
+    // as well, which stays right across the wrap. Beyond 31 searches, every node
+    // is as stale as it can be.
+    int value_of(const Transposition_node& node) const {
+        const int age = std::min((generation_ - node.generation) & 0xFF, 31);
+        return node.depth - 8 * age;
+    }
+
+    std::vector<Transposition_cluster> clusters_;
     u64 mask_;
+    u8 generation_ = 0;
 };
 }
-
@@ -1,13 +1,19 @@
 /**
  * This file generates the 'magic bitboards' needed to generate moves efficiently
  * See: https://chessprogramming.wikispaces.com/Magic+Bitboards
- * Here we generate 'plain' magic bitboards, which use quite a lot of space.
- * Better implementations are available, but are a little more complex.
+ * Here we generate 'fancy' magic bitboards: each square has its own shift, only
+ * as large as the number of blocker bits of that square needs, and the move
+ * tables of all the squares are packed into a single table, each square
+ * starting at its own offset. The random numbers tried as magics come from a
+ * fixed seed, so the same tables are generated every time. See Options for how
+ * the search can be tuned.
+ *
+ * Compiled with -DPEXT, it instead generates tables indexed with the BMI2 PEXT
+ * instruction, which needs no magic numbers (see generate_pext_move_lookup_tables).
  */
 
 #include "chess/chess.h"
 
-#include <cstring>
 #include <cstdio>
 
 #include <vector>
@@ -101,13 +107,13 @@ template <>
 Bitboard magic_bitboard_lookup_table<Piece::bishop>[64]{};
 
 template <Piece>
-int move_lookup_table = 0;
+int magic_shift_table[64]{};
 
-template <>
-Bitboard move_lookup_table<Piece::rook>[64][4096]{};
+template <Piece>
+std::vector<Bitboard> move_lookup_table;
 
-template <>
-Bitboard move_lookup_table<Piece::bishop>[64][512]{};
+template <Piece>
+int move_offset_table[64]{};
 
 void print(Bitboard b) {
     std::bitset<64> bs = b;
@@ -214,55 +220,183 @@ Bitboard move_bitboard_from_blocker<Piece::bishop>(Bitboard blocker, Location l)
     return move;
 }
 
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <random>
-#include <limits>
+#include <thread>
 
-u64 random_u64() {
-    static std::mt19937 gen{std::random_device{}()};
-    return std::uniform_int_distribution<u64>{0, std::numeric_limits<u64>::max()}(gen);
-}
+/**
+ * Options, given on the command line:
+ *   --threads N    Search for magics on N threads (default: all of them)
+ *   --seed S       Seed for the random candidates (default: 0x5EED5EED5EED5EED)
+ *   --minimise X   'bits': also look for magics with fewer index bits than the
+ *                  square has blocker bits, halving its table each time
+ *                  'size': keep the candidate whose largest index is lowest,
+ *                  so that the unused end of the table can be cut off
+ *   --attempts N   How many candidates to try per square when minimising
+ *
+ * The candidates for each square come from a generator seeded by the seed, the
+ * piece and the square, so the tables depend only on the options, and not on
+ * the number of threads or on how the squares are shared out between them.
+ */
+struct Options {
+    enum class Minimise { nothing, bits, size };
 
-template <Piece piece>
-void generate_magic_bitboards_and_move_lookup_tables()
-{
-    for (int l = 0; l < 64; ++l) {
-        constexpr auto key_bits = (piece == Piece::bishop ? 9 : 12);
-        Bitboard database[1 << key_bits]{};
+    unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+    u64 seed = 0x5EED5EED5EED5EED;
+    Minimise minimise = Minimise::nothing;
+    long attempts = 100000;
+};
 
-        const Bitboard attack_board = attack_lookup_table<piece>[l];
-        const auto blocker_boards = enumerate_all_possible_blocker_boards(attack_board);
+Options options;
+
+/**
+ * The magic found for one square, and the moves it indexes, up to the largest
+ * index used
+ */
+struct Square_magic {
+    u64 magic = 0;
+    int bits = 0;
+    std::vector<Bitboard> moves;
+};
 
-        u64 magic = 0;
+template <Piece piece>
+Square_magic find_magic(int l)
+{
+    const Bitboard attack_board = attack_lookup_table<piece>[l];
+    const auto blocker_boards = enumerate_all_possible_blocker_boards(attack_board);
 
-        while (true) {
-            bool good_magic = true;
+    std::vector<Bitboard> moves;
+    for (const auto blocker_board : blocker_boards) {
+        moves.push_back(move_bitboard_from_blocker<piece>(blocker_board, l));
+    }
 
-            for (const auto blocker_board : blocker_boards) {
-                const int index = (blocker_board * magic) >> (64 - key_bits);
+    std::mt19937_64 gen{options.seed ^ ((u64(piece) << 8 | u64(l)) * 0x9E3779B97F4A7C15)};
+    const auto random_candidate = [&gen] { return gen() & gen() & gen(); };
+
+    // Entries of the database are only valid if they were written in the
+    // current attempt, so it needn't be cleared between attempts
+    std::vector<Bitboard> database(std::size_t(1) << count(attack_board));
+    std::vector<u32> written_in(database.size());
+    u32 attempt = 0;
+
+    // Returns the largest index used by the magic, or -1 if it doesn't work
+    const auto try_magic = [&](u64 magic, int bits) -> long {
+        ++attempt;
+        long largest_index = 0;
+        for (std::size_t i = 0; i < blocker_boards.size(); ++i) {
+            const long index = (blocker_boards[i] * magic) >> (64 - bits);
+            if (written_in[index] != attempt) {
+                written_in[index] = attempt;
+                database[index] = moves[i];
+                largest_index = std::max(largest_index, index);
+            } else if (database[index] != moves[i]) {
+                return -1;
+            }
+        }
+        return largest_index;
+    };
+
+    Square_magic result;
+    result.bits = count(attack_board);
+    long largest_index = -1;
+    while (largest_index < 0) {
+        result.magic = random_candidate();
+        largest_index = try_magic(result.magic, result.bits);
+    }
 
-                const Bitboard move = move_bitboard_from_blocker<piece>(blocker_board, l);
-                if (database[index] == 0) {
-                    database[index] = move;
-                } else {
-                    if (database[index] != move) {
-                        good_magic = false;
-                        break;
-                    }
-                }
+    if (options.minimise == Options::Minimise::bits) {
+        for (int bits = result.bits - 1; bits > 0; --bits) {
+            long found = -1;
+            u64 magic = 0;
+            for (long i = 0; i < options.attempts && found < 0; ++i) {
+                magic = random_candidate();
+                found = try_magic(magic, bits);
+            }
+            if (found < 0) break;
+            result.magic = magic;
+            result.bits = bits;
+            largest_index = found;
+        }
+    } else if (options.minimise == Options::Minimise::size) {
+        for (long i = 0; i < options.attempts; ++i) {
+            const u64 magic = random_candidate();
+            const long found = try_magic(magic, result.bits);
+            if (found >= 0 && found < largest_index) {
+                result.magic = magic;
+                largest_index = found;
             }
+        }
+    }
 
-            if (good_magic) break;
+    // The database holds the last candidate tried, so fill it in again
+    try_magic(result.magic, result.bits);
+    result.moves.assign(database.begin(), database.begin() + largest_index + 1);
+    for (long i = 0; i <= largest_index; ++i) {
+        if (written_in[i] != attempt) result.moves[i] = 0;
+    }
+
+    return result;
+}
 
-            good_magic = true;
-            for (auto& x : database) x = 0;
-            magic = (random_u64() & random_u64() & random_u64());
+/**
+ * Finds the magics of both pieces, sharing the squares out between threads
+ */
+void generate_magic_bitboards_and_move_lookup_tables()
+{
+    std::vector<Square_magic> rook_magics(64);
+    std::vector<Square_magic> bishop_magics(64);
+
+    std::atomic<int> next_job{0};
+    const auto work = [&] {
+        for (int job = next_job++; job < 128; job = next_job++) {
+            if (job < 64) {
+                rook_magics[job] = find_magic<Piece::rook>(job);
+            } else {
+                bishop_magics[job - 64] = find_magic<Piece::bishop>(job - 64);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < options.threads; ++i) threads.emplace_back(work);
+    work();
+    for (auto& thread : threads) thread.join();
+
+    const auto store = [](auto piece_tag, const std::vector<Square_magic>& magics) {
+        constexpr Piece piece = decltype(piece_tag)::value;
+        for (int l = 0; l < 64; ++l) {
+            magic_bitboard_lookup_table<piece>[l] = magics[l].magic;
+            magic_shift_table<piece>[l] = 64 - magics[l].bits;
+            move_offset_table<piece>[l] = move_lookup_table<piece>.size();
+            move_lookup_table<piece>.insert(move_lookup_table<piece>.end(),
+                                            magics[l].moves.begin(), magics[l].moves.end());
         }
+    };
+    store(std::integral_constant<Piece, Piece::rook>{}, rook_magics);
+    store(std::integral_constant<Piece, Piece::bishop>{}, bishop_magics);
+}
 
-        magic_bitboard_lookup_table<piece>[l] = magic;
+/**
+ * PEXT packs the blocker bits of a square together into an index, so each
+ * square needs exactly 2^(number of blocker bits) entries. The squares are
+ * stored one after another in a single table, each starting at its offset.
+ */
+template <Piece piece>
+void generate_pext_move_lookup_tables()
+{
+    auto& table = move_lookup_table<piece>;
+
+    for (int l = 0; l < 64; ++l) {
+        move_offset_table<piece>[l] = table.size();
 
-        // Want to do this but this syntax wouldn't perform a copy
-        //move_lookup_table<piece>[l] = database;
-        std::memcpy(move_lookup_table<piece>[l], database, (1 << key_bits) * 8);
+        // Blocker boards are enumerated in the order of their PEXT indices
+        const Bitboard attack_board = attack_lookup_table<piece>[l];
+        for (const auto blocker_board : enumerate_all_possible_blocker_boards(attack_board)) {
+            table.push_back(move_bitboard_from_blocker<piece>(blocker_board, l));
+        }
     }
 }
 
@@ -302,11 +436,28 @@ void print_magic_tables()
         std::printf("0x%016lx, ", magic_bitboard_lookup_table<Piece::bishop>[i]);
     }
     std::printf("\n};\n\n");
+
+    std::printf("template <Piece>\nconstexpr int magic_shift_table = 0;\n\n");
+
+    std::printf("template <>\nconstexpr u8 magic_shift_table<Piece::rook>[64] = {");
+    for (int i = 0; i < 64; ++i) {
+        if (i % 8 == 0) std::printf("\n    ");
+        std::printf("%2i, ", magic_shift_table<Piece::rook>[i]);
+    }
+    std::printf("\n};\n\n");
+
+    std::printf("template <>\nconstexpr u8 magic_shift_table<Piece::bishop>[64] = {");
+    for (int i = 0; i < 64; ++i) {
+        if (i % 8 == 0) std::printf("\n    ");
+        std::printf("%2i, ", magic_shift_table<Piece::bishop>[i]);
+    }
+    std::printf("\n};\n\n");
 }
 
 void print_move_tables()
 {
     std::printf("template <Piece>\nconstexpr int move_lookup_table = 0;\n\n");
+    std::printf("template <Piece>\nconstexpr int move_offset_table = 0;\n\n");
 
     std::printf(
     "template <>\n"
@@ -347,38 +498,70 @@ void print_move_tables()
     "    0x0203000000000000, 0x0507000000000000, 0x0A0E000000000000, 0x141C000000000000,\n"
     "    0x2838000000000000, 0x5070000000000000, 0xA0E0000000000000, 0x40C0000000000000,\n"
     "};\n\n");
+}
 
-    std::printf("template <>\nconstexpr Bitboard move_lookup_table<Piece::rook>[64][4096] = {\n");
-    for (int i = 0; i < 64; ++i) {
-        std::printf("    {");
-
-        for (int j = 0; j < 4096; ++j) {
-            if (j % 4 == 0) std::printf("\n        ");
-            std::printf("0x%016lx, ", move_lookup_table<Piece::rook>[i][j]);
-        }
+template <Piece piece>
+void print_sliding_move_tables(const char* name)
+{
+    const auto& table = move_lookup_table<piece>;
 
-        std::printf("\n    },\n");
+    std::printf("template <>\nconstexpr int move_offset_table<Piece::%s>[64] = {", name);
+    for (int i = 0; i < 64; ++i) {
+        if (i % 8 == 0) std::printf("\n    ");
+        std::printf("%6i, ", move_offset_table<piece>[i]);
     }
-    std::printf("};\n\n");
+    std::printf("\n};\n\n");
 
-    std::printf("template <>\nconstexpr Bitboard move_lookup_table<Piece::bishop>[64][512] = {\n");
-    for (int i = 0; i < 64; ++i) {
-        std::printf("    {");
+    std::printf("template <>\nconstexpr Bitboard move_lookup_table<Piece::%s>[%zu] = {", name,
+                table.size());
+    for (std::size_t i = 0; i < table.size(); ++i) {
+        if (i % 4 == 0) std::printf("\n    ");
+        std::printf("0x%016lx, ", table[i]);
+    }
+    std::printf("\n};\n\n");
+}
 
-        for (int j = 0; j < 512; ++j) {
-            if (j % 4 == 0) std::printf("\n        ");
-            std::printf("0x%016lx, ", move_lookup_table<Piece::bishop>[i][j]);
+void parse_options(int argc, char** argv)
+{
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const char* value = argv[i + 1];
+        if (std::strcmp(argv[i], "--threads") == 0) {
+            options.threads = std::max(std::atoi(value), 1);
+        } else if (std::strcmp(argv[i], "--seed") == 0) {
+            options.seed = std::strtoull(value, nullptr, 0);
+        } else if (std::strcmp(argv[i], "--attempts") == 0) {
+            options.attempts = std::atol(value);
+        } else if (std::strcmp(argv[i], "--minimise") == 0 && std::strcmp(value, "bits") == 0) {
+            options.minimise = Options::Minimise::bits;
+        } else if (std::strcmp(argv[i], "--minimise") == 0 && std::strcmp(value, "size") == 0) {
+            options.minimise = Options::Minimise::size;
+        } else {
+            std::fprintf(stderr, "Unknown option: %s %s\n", argv[i], value);
+            std::exit(1);
         }
-
-        std::printf("\n    },\n");
     }
-    std::printf("};\n\n");
 }
 
-int main()
+int main(int argc, char** argv)
 {
-    generate_magic_bitboards_and_move_lookup_tables<Piece::rook>();
-    generate_magic_bitboards_and_move_lookup_tables<Piece::bishop>();
+    parse_options(argc, argv);
+
+    const auto start = std::chrono::steady_clock::now();
+#ifdef PEXT
+    generate_pext_move_lookup_tables<Piece::rook>();
+    generate_pext_move_lookup_tables<Piece::bishop>();
+#else
+    generate_magic_bitboards_and_move_lookup_tables();
+#endif
+    const std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+
+    // The tables go to stdout, so report on stderr
+    std::fprintf(stderr, "Rook table:   %6zu entries (%zu KB)\n",
+                 move_lookup_table<Piece::rook>.size(), move_lookup_table<Piece::rook>.size() / 128);
+    std::fprintf(stderr, "Bishop table: %6zu entries (%zu KB)\n",
+                 move_lookup_table<Piece::bishop>.size(),
+                 move_lookup_table<Piece::bishop>.size() / 128);
+    std::fprintf(stderr, "Generated in %.2fs on %u threads\n", time.count(), options.threads);
 
     std::printf("#pragma once\n\n");
 
@@ -388,8 +571,12 @@ int main()
     std::printf("namespace Chess {\n\n");
 
     print_attack_tables();
+#ifndef PEXT
     print_magic_tables();
+#endif
     print_move_tables();
+    print_sliding_move_tables<Piece::rook>("rook");
+    print_sliding_move_tables<Piece::bishop>("bishop");
 
     std::printf("}  // namespace Chess\n\n");
 }
@@ -0,0 +1,49 @@
+/**
+ * Times perft over the positions of the perft test suite, as a benchmark of
+ * move generation. `make bench_sliders` runs it once for each sliding piece
+ * lookup backend.
+ */
+
+#include "chess/chess.h"
+#include "perft.h"
+
+#include <chrono>
+#include <cstdio>
+
+using namespace Chess;
+
+int main(int argc, char** argv)
+{
+    struct Test {
+        const char* fen;
+        int ply;
+    };
+
+    constexpr Test suite[] = {
+        {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 6},
+        {"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 5},
+        {"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 6},
+        {"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 5},
+        {"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", 5},
+        {"r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10", 5},
+    };
+
+    long long total_nodes = 0;
+    double total_time = 0;
+
+    for (const auto& test : suite) {
+        auto position = Position::from_fen(test.fen);
+
+        const auto start = std::chrono::steady_clock::now();
+        const long long nodes = count_moves_make_unmake(position, test.ply);
+        const std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+
+        std::printf("%-72s %i: %11lli nodes in %6.3fs\n", test.fen, test.ply, nodes,
+                    time.count());
+        total_nodes += nodes;
+        total_time += time.count();
+    }
+
+    std::printf("%s: %lli nodes in %.3fs (%.0f nps)\n", argc > 1 ? argv[1] : "Total",
+                total_nodes, total_time, total_nodes / total_time);
+}
@@ -0,0 +1,148 @@
+#include "chess/batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace Chess {
+
+struct Batch_analyser::Pool {
+    struct Worker {
+        explicit Worker(u8 tt_log_size)
+            : tt{tt_log_size}
+        {}
+
+        Transposition_table tt;
+        u64 nodes = 0;
+        std::thread thread;
+    };
+
+    Pool(int num_workers, u8 tt_log_size) {
+        for (int i = 0; i < num_workers; ++i) {
+            workers.push_back(std::make_unique<Worker>(tt_log_size));
+        }
+        for (auto& worker : workers) {
+            worker->thread = std::thread([this, &worker = *worker] { this->run(worker); });
+        }
+    }
+
+    ~Pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            shutting_down = true;
+        }
+        work_ready.notify_all();
+        for (auto& worker : workers) worker->thread.join();
+    }
+
+    void analyse(Span<Position> new_positions, const Search_options& new_options,
+                 std::vector<Recommendation>& new_results)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            positions = new_positions;
+            options = new_options;
+            options.threads = 1;
+            results = &new_results;
+            next = 0;
+            busy = int(workers.size());
+            ++batch;
+        }
+        work_ready.notify_all();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        work_done.wait(lock, [this] { return busy == 0; });
+    }
+
+    /**
+     * The loop run by each worker thread. Between batches, workers sleep until
+     * the batch number changes.
+     */
+    void run(Worker& worker) {
+        u64 last_batch = 0;
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_ready.wait(lock, [&] { return shutting_down || batch != last_batch; });
+                if (shutting_down) return;
+                last_batch = batch;
+            }
+
+            Recommendation result;
+            u64 nodes = 0;
+
+            Io io;
+            io.report_best_move = [&result](Move m) { result.move = m; };
+            io.report_score     = [&result](i16 s) { result.score = s; };
+            io.report_iteration = [&nodes](int, i16, Move_span, const Search_stats& stats) {
+                nodes = stats.nodes;
+            };
+
+            for (std::size_t i = next++; i < positions.size(); i = next++) {
+                recommend_move(io, positions[i], worker.tt, options);
+                (*results)[i] = result;
+                worker.nodes += nodes;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy == 0) work_done.notify_one();
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    u64 batch = 0;  // Incremented to start each batch
+    int busy = 0;   // Workers yet to finish the current batch
+    bool shutting_down = false;
+
+    // The current batch
+    Span<Position> positions;
+    Search_options options;
+    std::vector<Recommendation>* results = nullptr;
+    std::atomic<std::size_t> next = 0;  // Index of the next position to hand out
+};
+
+Batch_analyser::Batch_analyser(int workers, u8 tt_log_size)
+{
+    if (workers <= 0) workers = std::max(int(std::thread::hardware_concurrency()), 1);
+    pool_ = std::make_unique<Pool>(workers, tt_log_size);
+}
+
+Batch_analyser::~Batch_analyser() = default;
+
+std::vector<Recommendation> Batch_analyser::analyse(Span<Position> positions,
+                                                    const Search_options& options)
+{
+    const auto start = std::chrono::steady_clock::now();
+    for (auto& worker : pool_->workers) worker->nodes = 0;
+
+    std::vector<Recommendation> results(positions.size());
+    pool_->analyse(positions, options, results);
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+
+    stats_ = {};
+    stats_.positions = positions.size();
+    for (const auto& worker : pool_->workers) stats_.nodes += worker->nodes;
+    stats_.time = elapsed.count() / 1000;
+    if (elapsed.count() > 0) {
+        stats_.positions_per_second = positions.size() * 1e6 / elapsed.count();
+    }
+
+    return results;
+}
+
+int Batch_analyser::workers() const
+{
+    return int(pool_->workers.size());
+}
+
+}  // namespace Chess
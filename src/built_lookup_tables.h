@@ -0,0 +1,282 @@
+#pragma once
+
+#include "chess/bitboard.h"
+#include "chess/misc.h"
+
+#include <cstdlib>
+
+/**
+ * Builds the lookup tables inside the library, as an alternative to generating
+ * lookup_tables.h with meta/gen.cpp, and provides them under the same names.
+ * With -DCONSTEXPR_TABLES the tables are built by the compiler, and with
+ * -DSTARTUP_TABLES they are built when the program starts.
+ *
+ * The magic numbers are a fixed list, found by meta/gen.cpp with its default
+ * seed. With -DPEXT, they aren't used.
+ */
+
+namespace Chess {
+
+namespace Built_tables {
+
+constexpr Bitboard rook_magics[64] = {
+    0x808008c001908020, 0x0040012000500840, 0x1100092001001140, 0x0080100008008004,
+    0x3880020801440080, 0x2600081062000104, 0x8080420001000080, 0x060002408c002a01,
+    0x2815800029804010, 0x00490020c0008101, 0x0042801000200088, 0x08910008b0050020,
+    0x000a800401810800, 0x4802000201100804, 0x8043000401000200, 0x1002000044010082,
+    0x0000288000400084, 0x4101808020004000, 0x0100808010002000, 0x0000190010002100,
+    0x0510850030280100, 0x8012008100800400, 0x0000040007c80610, 0x6001020000442089,
+    0x8006400880002484, 0x410a024200210081, 0x6002200080100081, 0x3000100080800800,
+    0x002a080080800400, 0x0236002200488410, 0x2201000500040200, 0x0208800480004100,
+    0x0000824004800160, 0x0010004000c02000, 0x1018104301002000, 0x8040100080801800,
+    0x20810008010014b0, 0x2210d40080800200, 0x800200381a000c41, 0x5010850142000094,
+    0x80022080c0088002, 0x003001200b504001, 0x0001014820030010, 0x000600401c220010,
+    0x8002002008120004, 0x0104000810020200, 0x2804120001008080, 0x0048405402820001,
+    0x0040400024800080, 0x0012200281c00880, 0x4081002008421500, 0x1400100080080280,
+    0x1204808800440080, 0x10000a000c008080, 0x1002020148108400, 0x102004840a410200,
+    0x2001004011800025, 0x0001218010400501, 0x0080c10010182003, 0x5442008408402012,
+    0x1109001008008413, 0x0012000c50084352, 0x0800010882100804, 0x4a140024004d0082,
+};
+
+constexpr Bitboard bishop_magics[64] = {
+    0x0020040498010062, 0x08100188150840e0, 0x0008280040808000, 0x4004240080202091,
+    0x200410441002e010, 0x4001110840001000, 0x0102882802108070, 0x011104090d080200,
+    0x000011a028088080, 0x0000100301050200, 0x2029098204010000, 0x2100080610400010,
+    0x22180110400c4000, 0x0000038220202c80, 0x0220040c040a0910, 0x1888088145082004,
+    0x0510000810012810, 0x4a14000809340400, 0x00501303010a0050, 0x210c000824021004,
+    0x0105000820080380, 0x0138408200422000, 0x0014401101301100, 0x000a241511011000,
+    0x0084060010101070, 0x0044110020630100, 0x0400208044080080, 0x0242180014004039,
+    0x0061010020104000, 0x04500090a1004804, 0x000a219000541002, 0x01050200a5034102,
+    0x440808080804a080, 0x10108808002002d4, 0x1102002410020801, 0x8019820082180080,
+    0x0004420400220090, 0x00200c0040e28800, 0x0001040880040220, 0xe04900ca80820220,
+    0x00009004a0213000, 0x0041040246202000, 0x0300602028001000, 0x0028024022001020,
+    0x0282080100402400, 0x0018100186000098, 0x080808818c040080, 0x4408020040c0aa00,
+    0x0092088221100121, 0x2402028608820410, 0x0008028048086100, 0x3a02100020880080,
+    0xa000001026020080, 0x4600200202020148, 0x20040404082200a5, 0x4024109404408800,
+    0x0080508088084000, 0x0882202401086800, 0x0401240602194400, 0x0100020000219801,
+    0x3000800250020200, 0x04102208a0081882, 0x4000e00210060280, 0x0262020408020540,
+};
+
+// The moves from a location along the given directions, where each direction is
+// a step in columns and rows. Each ray stops at the first blocker, including it.
+template <int num_directions>
+constexpr Bitboard ray_moves(int l, Bitboard blockers, const int (&directions)[num_directions][2],
+                             bool single_step = false)
+{
+    Bitboard moves = 0;
+
+    for (const auto& direction : directions) {
+        int c = l % 8 + direction[0];
+        int r = l / 8 + direction[1];
+
+        while (c >= 0 && c < 8 && r >= 0 && r < 8) {
+            moves |= Bitboard(1) << (r * 8 + c);
+            if (single_step || (blockers & (Bitboard(1) << (r * 8 + c)))) break;
+            c += direction[0];
+            r += direction[1];
+        }
+    }
+
+    return moves;
+}
+
+constexpr int rook_directions[4][2]   = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+constexpr int bishop_directions[4][2] = {{1, 1}, {-1, 1}, {1, -1}, {-1, -1}};
+constexpr int knight_directions[8][2] = {{1, 2}, {2, 1}, {2, -1}, {1, -2},
+                                         {-1, -2}, {-2, -1}, {-2, 1}, {-1, 2}};
+constexpr int king_directions[8][2]   = {{1, 0}, {1, 1}, {0, 1}, {-1, 1},
+                                         {-1, 0}, {-1, -1}, {0, -1}, {1, -1}};
+
+template <Piece piece>
+constexpr Bitboard sliding_moves(int l, Bitboard blockers)
+{
+    return piece == Piece::rook ? ray_moves(l, blockers, rook_directions)
+                                : ray_moves(l, blockers, bishop_directions);
+}
+
+// The locations whose occupancy can block the piece: the moves on an empty board,
+// less the last location of each ray
+template <Piece piece>
+constexpr Bitboard attack_mask(int l)
+{
+    constexpr Bitboard edges_of_row = 0x8181818181818181;
+    constexpr Bitboard edges_of_col = 0xFF000000000000FF;
+
+    const Bitboard row_of_l = Bitboard(0xFF) << (l / 8 * 8);
+    const Bitboard col_of_l = Bitboard(0x0101010101010101) << (l % 8);
+
+    const Bitboard moves = sliding_moves<piece>(l, 0);
+    if (piece == Piece::bishop) return moves & ~(edges_of_row | edges_of_col);
+
+    return (moves & row_of_l & ~edges_of_row) | (moves & col_of_l & ~edges_of_col);
+}
+
+// Software PEXT: gathers the bits of x selected by the mask into the low bits
+constexpr u64 parallel_extract(u64 x, u64 mask)
+{
+    u64 result = 0;
+    for (u64 bit = 1; mask; bit <<= 1, mask &= mask - 1) {
+        if (x & mask & -mask) result |= bit;
+    }
+    return result;
+}
+
+template <Piece piece>
+constexpr std::size_t move_table_size()
+{
+    std::size_t size = 0;
+    for (int l = 0; l < 64; ++l) size += std::size_t(1) << count(attack_mask<piece>(l));
+    return size;
+}
+
+template <Piece piece>
+struct Sliding_tables {
+    Bitboard attack_masks[64] = {};
+    u8 shifts[64] = {};
+    int offsets[64] = {};
+    Bitboard moves[move_table_size<piece>()] = {};
+};
+
+// Returns false if two sets of blockers with different moves share an index, which
+// means a magic number is wrong. Every entry has some moves, so an empty entry
+// hasn't been filled yet.
+template <Piece piece>
+constexpr bool fill(Sliding_tables<piece>& tables)
+{
+#ifndef PEXT
+    const auto& magics = piece == Piece::rook ? rook_magics : bishop_magics;
+#endif
+
+    int offset = 0;
+    for (int l = 0; l < 64; ++l) {
+        const Bitboard mask = attack_mask<piece>(l);
+        const int bits = count(mask);
+
+        tables.attack_masks[l] = mask;
+        tables.shifts[l] = 64 - bits;
+        tables.offsets[l] = offset;
+
+        // Visit every subset of the mask
+        Bitboard blockers = 0;
+        do {
+#ifdef PEXT
+            const auto index = parallel_extract(blockers, mask);
+#else
+            const auto index = (blockers * magics[l]) >> (64 - bits);
+#endif
+            const Bitboard moves = sliding_moves<piece>(l, blockers);
+            if (tables.moves[offset + index] && tables.moves[offset + index] != moves) return false;
+            tables.moves[offset + index] = moves;
+            blockers = (blockers - mask) & mask;
+        } while (blockers);
+
+        offset += 1 << bits;
+    }
+
+    return true;
+}
+
+struct Step_tables {
+    Bitboard knight[64] = {};
+    Bitboard king[64] = {};
+};
+
+constexpr Step_tables make_step_tables()
+{
+    Step_tables tables;
+    for (int l = 0; l < 64; ++l) {
+        tables.knight[l] = ray_moves(l, 0, knight_directions, true);
+        tables.king[l] = ray_moves(l, 0, king_directions, true);
+    }
+    return tables;
+}
+
+constexpr Step_tables step_tables = make_step_tables();
+
+#ifdef CONSTEXPR_TABLES
+
+constexpr auto rook_tables = [] {
+    Sliding_tables<Piece::rook> tables;
+    if (!fill(tables)) throw "colliding rook magic";
+    return tables;
+}();
+
+constexpr auto bishop_tables = [] {
+    Sliding_tables<Piece::bishop> tables;
+    if (!fill(tables)) throw "colliding bishop magic";
+    return tables;
+}();
+
+#else
+
+template <Piece piece>
+struct Startup_tables : Sliding_tables<piece> {
+    Startup_tables()
+    {
+        if (!fill(*this)) std::abort();
+    }
+};
+
+// Filled in by dynamic initialisation, ahead of every global that has no
+// priority of its own, in any translation unit, so that those globals can
+// generate moves. init_priority is a GCC and Clang extension, and 101 is the
+// first priority that isn't reserved for the implementation.
+__attribute__ ((init_priority (101))) inline Startup_tables<Piece::rook> rook_tables;
+__attribute__ ((init_priority (101))) inline Startup_tables<Piece::bishop> bishop_tables;
+
+#endif
+
+}  // namespace Built_tables
+
+template <Piece>
+constexpr int attack_lookup_table = 0;
+
+template <>
+constexpr auto& attack_lookup_table<Piece::rook> = Built_tables::rook_tables.attack_masks;
+
+template <>
+constexpr auto& attack_lookup_table<Piece::bishop> = Built_tables::bishop_tables.attack_masks;
+
+template <Piece>
+constexpr int magic_bitboard_lookup_table = 0;
+
+template <>
+constexpr auto& magic_bitboard_lookup_table<Piece::rook> = Built_tables::rook_magics;
+
+template <>
+constexpr auto& magic_bitboard_lookup_table<Piece::bishop> = Built_tables::bishop_magics;
+
+template <Piece>
+constexpr int magic_shift_table = 0;
+
+template <>
+constexpr auto& magic_shift_table<Piece::rook> = Built_tables::rook_tables.shifts;
+
+template <>
+constexpr auto& magic_shift_table<Piece::bishop> = Built_tables::bishop_tables.shifts;
+
+template <Piece>
+constexpr int move_offset_table = 0;
+
+template <>
+constexpr auto& move_offset_table<Piece::rook> = Built_tables::rook_tables.offsets;
+
+template <>
+constexpr auto& move_offset_table<Piece::bishop> = Built_tables::bishop_tables.offsets;
+
+template <Piece>
+constexpr int move_lookup_table = 0;
+
+template <>
+constexpr auto& move_lookup_table<Piece::rook> = Built_tables::rook_tables.moves;
+
+template <>
+constexpr auto& move_lookup_table<Piece::bishop> = Built_tables::bishop_tables.moves;
+
+template <>
+constexpr auto& move_lookup_table<Piece::knight> = Built_tables::step_tables.knight;
+
+template <>
+constexpr auto& move_lookup_table<Piece::king> = Built_tables::step_tables.king;
+
+}  // namespace Chess
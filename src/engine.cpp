@@ -0,0 +1,91 @@
+#include "chess/engine.h"
+#include "move_picker.h"
+#include "search.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+
+namespace Chess {
+
+struct Engine::State {
+    State(int threads, u8 tt_log_size)
+        : tt{tt_log_size}, main{1}, helpers{threads - 1}
+    {
+        for (int i = 0; i < threads; ++i) {
+            histories.push_back(std::make_unique<Search_history>());
+            history_pointers.push_back(histories.back().get());
+        }
+    }
+
+    Transposition_table tt;
+    std::vector<std::unique_ptr<Search_history>> histories;
+    std::vector<Search_history*> history_pointers;
+
+    // The main search thread is kept apart from the helpers, so that go() can
+    // return while it runs
+    Thread_pool main;
+    Thread_pool helpers;
+
+    Io* io = nullptr;  // The Io object of the search going, if any
+    std::vector<Recommendation> results;
+};
+
+Engine::Engine(int threads, u8 tt_log_size)
+    : state_{std::make_unique<State>(std::max(threads, 1), tt_log_size)}
+{}
+
+Engine::~Engine()
+{
+    this->stop();
+}
+
+void Engine::go(Io& io, const Position& position, const Search_options& options)
+{
+    this->wait();
+
+    for (auto& history : state_->histories) history->age();
+
+    io.go();
+    state_->io = &io;
+
+    state_->main.run(0, [this, &io, position, options] {
+        state_->results = run_search(io, position, state_->tt, options,
+                                     state_->history_pointers, state_->helpers);
+    });
+}
+
+std::vector<Recommendation> Engine::stop()
+{
+    if (state_->io) state_->io->stop();
+    return this->wait();
+}
+
+std::vector<Recommendation> Engine::wait()
+{
+    state_->main.wait(0);
+    state_->io = nullptr;
+    return state_->results;
+}
+
+std::vector<Recommendation> Engine::search(const Position& position,
+                                           const Search_options& options)
+{
+    Io io;
+    this->go(io, position, options);
+    return this->wait();
+}
+
+void Engine::clear()
+{
+    this->wait();
+
+    state_->tt.clear();
+    for (auto& history : state_->histories) *history = Search_history();
+}
+
+int Engine::threads() const
+{
+    return int(state_->histories.size());
+}
+
+}  // namespace Chess
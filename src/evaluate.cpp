@@ -1,253 +1,670 @@
 #include "chess/evaluate.h"
 #include "chess/generate_moves.h"
 #include "chess/transposition_table.h"
+#include "move_picker.h"
+#include "search.h"
+#include "thread_pool.h"
+#include "time_manager.h"
 
 #include <algorithm>
 #include <utility>
 #include <memory>
 #include <tuple>
+#include <thread>
+#include <vector>
 
 namespace Chess {
 
 namespace {
 
-constexpr i16 piece_evaluation_tables[13][64] = {
-    {  // White rooks
-          0,   0,   0,   5,   5,   0,   0,   0,
-         -5,   0,   0,   0,   0,   0,   0,  -5,
-         -5,   0,   0,   0,   0,   0,   0,  -5,
-         -5,   0,   0,   0,   0,   0,   0,  -5,
-         -5,   0,   0,   0,   0,   0,   0,  -5,
-         -5,   0,   0,   0,   0,   0,   0,  -5,
-          5,  10,  10,  10,  10,  10,  10,   5,
-          0,   0,   0,   0,   0,   0,   0,   0,
-    }, {  // Black rooks
-          0,   0,   0,   0,   0,   0,   0,   0,
-          5,  10,  10,  10,  10,  10,  10,   5,
-         -5,   0,   0,   0,   0,   0,   0,  -5,
-         -5,   0,   0,   0,   0,   0,   0,  -5,
-         -5,   0,   0,   0,   0,   0,   0,  -5,
-         -5,   0,   0,   0,   0,   0,   0,  -5,
-         -5,   0,   0,   0,   0,   0,   0,  -5,
-          0,   0,   0,   5,   5,   0,   0,   0,
-    }, {  // White knights
-        -50, -40, -30, -30, -30, -30, -40, -50,
-        -40, -20,   0,   5,   5,   0, -20, -40,
-        -30,   5,  10,  15,  15,  10,   5, -30,
-        -30,   0,  15,  20,  20,  15,   0, -30,
-        -30,   5,  15,  20,  20,  15,   5, -30,
-        -30,   0,  10,  15,  15,  10,   0, -30,
-        -40, -20,   0,   0,   0,   0, -20, -40,
-        -50, -40, -30, -30, -30, -30, -40, -50,
-    }, {  // Black knights
-        -50, -40, -30, -30, -30, -30, -40, -50,
-        -40, -20,   0,   0,   0,   0, -20, -40,
-        -30,   0,  10,  15,  15,  10,   0, -30,
-        -30,   5,  15,  20,  20,  15,   5, -30,
-        -30,   0,  15,  20,  20,  15,   0, -30,
-        -30,   5,  10,  15,  15,  10,   5, -30,
-        -40, -20,   0,   5,   5,   0, -20, -40,
-        -50, -40, -30, -30, -30, -30, -40, -50,
-    }, {  // White bishops
-        -20, -10, -10, -10, -10, -10, -10, -20,
-        -10,   5,   0,   0,   0,   0,   5, -10,
-        -10,  10,  10,  10,  10,  10,  10, -10,
-        -10,   0,  10,  10,  10,  10,   0, -10,
-        -10,   5,   5,  10,  10,   5,   5, -10,
-        -10,   0,   5,  10,  10,   5,   0, -10,
-        -10,   0,   0,   0,   0,   0,   0, -10,
-        -20, -10, -10, -10, -10, -10, -10, -20,
-    }, {  // Black bishops
-        -20, -10, -10, -10, -10, -10, -10, -20,
-        -10,   0,   0,   0,   0,   0,   0, -10,
-        -10,   0,   5,  10,  10,   5,   0, -10,
-        -10,   5,   5,  10,  10,   5,   5, -10,
-        -10,   0,  10,  10,  10,  10,   0, -10,
-        -10,  10,  10,  10,  10,  10,  10, -10,
-        -10,   5,   0,   0,   0,   0,   5, -10,
-        -20, -10, -10, -10, -10, -10, -10, -20,
-    }, {  // White queens
-        -20, -10, -10,  -5,  -5, -10, -10, -20,
-        -10,   0,   5,   0,   0,   0,   0, -10,
-        -10,   5,   5,   5,   5,   5,   0, -10,
-          0,   0,   5,   5,   5,   5,   0,  -5,
-         -5,   0,   5,   5,   5,   5,   0,  -5,
-        -10,   0,   5,   5,   5,   5,   0, -10,
-        -10,   0,   0,   0,   0,   0,   0, -10,
-        -20, -10, -10,  -5,  -5, -10, -10, -20,
-    }, {  // Black queens
-        -20, -10, -10,  -5,  -5, -10, -10, -20,
-        -10,   0,   0,   0,   0,   0,   0, -10,
-        -10,   0,   5,   5,   5,   5,   0, -10,
-         -5,   0,   5,   5,   5,   5,   0,  -5,
-          0,   0,   5,   5,   5,   5,   0,  -5,
-        -10,   5,   5,   5,   5,   5,   0, -10,
-        -10,   0,   5,   0,   0,   0,   0, -10,
-        -20, -10, -10,  -5,  -5, -10, -10, -20,
-    }, {  // White king
-         20,  30,  10,   0,   0,  10,  30,  20,
-         20,  20,   0,   0,   0,   0,  20,  20,
-        -10, -20, -20, -20, -20, -20, -20, -10,
-        -20, -30, -30, -40, -40, -30, -30, -20,
-        -30, -40, -40, -50, -50, -40, -40, -30,
-        -30, -40, -40, -50, -50, -40, -40, -30,
-        -30, -40, -40, -50, -50, -40, -40, -30,
-        -30, -40, -40, -50, -50, -40, -40, -30,
-    }, {  // Black king
-        -30, -40, -40, -50, -50, -40, -40, -30,
-        -30, -40, -40, -50, -50, -40, -40, -30,
-        -30, -40, -40, -50, -50, -40, -40, -30,
-        -30, -40, -40, -50, -50, -40, -40, -30,
-        -20, -30, -30, -40, -40, -30, -30, -20,
-        -10, -20, -20, -20, -20, -20, -20, -10,
-         20,  20,   0,   0,   0,   0,  20,  20,
-         20,  30,  10,   0,   0,  10,  30,  20,
-    }, {  // White pawns
-          0,   0,   0,   0,   0,   0,   0,   0,
-          5,  10,  10, -20, -20,  10,  10,   5,
-          5,  -5, -10,   0,   0, -10,  -5,   5,
-          0,   0,   0,  20,  20,   0,   0,   0,
-          5,   5,  10,  25,  25,  10,   5,   5,
-         10,  10,  20,  30,  30,  20,  10,  10,
-         50,  50,  50,  50,  50,  50,  50,  50,
-          0,   0,   0,   0,   0,   0,   0,   0,
-    }, {  // Black pawns
-          0,   0,   0,   0,   0,   0,   0,   0,
-         50,  50,  50,  50,  50,  50,  50,  50,
-         10,  10,  20,  30,  30,  20,  10,  10,
-          5,   5,  10,  25,  25,  10,   5,   5,
-          0,   0,   0,  20,  20,   0,   0,   0,
-          5,  -5, -10,   0,   0, -10,  -5,   5,
-          5,  10,  10, -20, -20,  10,  10,   5,
-          0,   0,   0,   0,   0,   0,   0,   0,
-    }, {  // Empty
-          0,   0,   0,   0,   0,   0,   0,   0,
-          0,   0,   0,   0,   0,   0,   0,   0,
-          0,   0,   0,   0,   0,   0,   0,   0,
-          0,   0,   0,   0,   0,   0,   0,   0,
-          0,   0,   0,   0,   0,   0,   0,   0,
-          0,   0,   0,   0,   0,   0,   0,   0,
-          0,   0,   0,   0,   0,   0,   0,   0,
-          0,   0,   0,   0,   0,   0,   0,   0,
-    }
-};
-
-constexpr i16 nominal_value[13] = {
-    500, 500,  // Rook
-    300, 300,  // Knight
-    300, 300,  // Bishop
-    900, 900,  // Queen
-      0,   0,  // King
-    100, 100,  // Pawn
-      0,       // Empty
-};
-
 constexpr i16 big = 10000;
 
-i16 static_evaluate(const Position& position)
+/**
+ * The score of a position in which the side to move has no moves, given how
+ * many plies from the root it is. Being mated sooner is worse.
+ */
+i16 game_over_score(const Position& position, int ply)
 {
-    i16 score = 0;
+    return in_check(position) ? -big + ply : 0;
+}
 
-    for (int location = 0; location < 64; ++location) {
-        const auto square = position.mailbox[location];
-        i16 piece_value = nominal_value[*square] + piece_evaluation_tables[*square][location];
-        if (is_black(square)) piece_value = -piece_value;
-        score += piece_value;
-    }
+// Scores beyond this are mates, found within max_ply plies
+constexpr i16 mate_bound = big - max_ply;
+
+/**
+ * Mate scores count plies from the root, but a node may be found in the table
+ * at a different ply to where it was stored. So they are stored counting plies
+ * from the node itself instead, and converted back when probed.
+ */
+i16 score_to_table(i16 score, int ply)
+{
+    if (score >= mate_bound) return score + ply;
+    if (score <= -mate_bound) return score - ply;
+    return score;
+}
 
+i16 score_from_table(i16 score, int ply)
+{
+    if (score >= mate_bound) return score - ply;
+    if (score <= -mate_bound) return score + ply;
     return score;
 }
 
+// The position keeps its material and piece-square score up to date itself
+i16 static_evaluate(const Position& position)
+{
+    return position.score;
+}
+
 i16 invert_if_black(i16 score, Player p) {
     return score * (i16(p) * (-2) + 1);
 }
 
+// Whether the player to move has any pieces besides pawns and their king
+bool has_non_pawn_material(const Position& position)
+{
+    const Player p = position.active_player;
+    const Bitboard pawns_and_king = position.bitboard_by_square[*p | *Piece::pawn] |
+                                    position.bitboard_by_square[*p | *Piece::king];
+    return position.bitboard_by_player[*p] & ~pawns_and_king;
+}
+
 /**
- * Generates moves and then orders them according to whatever heuristics we
- * wish to use. Right now, we simply swap the front move with the one we deem
- * most likely to be best.
+ * Applies a move to a position for the lifetime of this object. By default the
+ * move is made in place and unmade again on destruction. Compiling with
+ * -DCOPY_MAKE instead makes a fresh copy of the position with the move applied,
+ * which is useful for benchmarking the two strategies against each other.
  */
-auto generate_ordered_moves(const Position& position, const u64 key,
-                            const Transposition_node& node)
+class Applied_move {
+public:
+    Applied_move(Position& position, Move move)
+#ifdef COPY_MAKE
+        : position_{apply(move, position)}
+#else
+        : position_{position}, move_{move}, undo_{make_move(position, move)}
+#endif
+    {}
+
+    Applied_move(const Applied_move&) = delete;
+    Applied_move& operator=(const Applied_move&) = delete;
+
+#ifndef COPY_MAKE
+    ~Applied_move() { unmake_move(position_, move_, undo_); }
+#endif
+
+    Position& position() { return position_; }
+private:
+#ifdef COPY_MAKE
+    Position position_;
+#else
+    Position& position_;
+    Move move_;
+    Undo_info undo_;
+#endif
+};
+
+/**
+ * Passes the turn for the lifetime of this object, in the same way as
+ * Applied_move
+ */
+class Applied_null_move {
+public:
+    explicit Applied_null_move(Position& position)
+#ifdef COPY_MAKE
+        : position_{position}
+    {
+        make_null_move(position_);
+    }
+#else
+        : position_{position}, undo_{make_null_move(position)}
+    {}
+#endif
+
+    Applied_null_move(const Applied_null_move&) = delete;
+    Applied_null_move& operator=(const Applied_null_move&) = delete;
+
+#ifndef COPY_MAKE
+    ~Applied_null_move() { unmake_null_move(position_, undo_); }
+#endif
+
+    Position& position() { return position_; }
+private:
+#ifdef COPY_MAKE
+    Position position_;
+#else
+    Position& position_;
+    Undo_info undo_;
+#endif
+};
+
+/**
+ * A statistic counted by one search thread, which the main thread may read at
+ * any time to report on. Only the owning thread writes to it, so it is updated
+ * with a relaxed load and store rather than a locked increment, which costs no
+ * more than a plain variable would.
+ */
+class Counter {
+public:
+    void operator++() { this->set(this->get() + 1); }
+
+    void raise_to(u64 value) {
+        if (value > this->get()) this->set(value);
+    }
+
+    u64 get() const { return value_.load(std::memory_order_relaxed); }
+private:
+    void set(u64 value) { value_.store(value, std::memory_order_relaxed); }
+
+    std::atomic<u64> value_ = 0;
+};
+
+/**
+ * The statistics kept by each search thread, which are summed into a
+ * Search_stats when they are reported
+ */
+struct Thread_stats {
+    Counter nodes;
+    Counter qnodes;
+    Counter seldepth;
+    Counter tt_probes;
+    Counter tt_hits;
+    Counter tt_writes;
+    Counter beta_cutoffs;
+    Counter first_move_cutoffs;
+
+    void add_to(Search_stats& stats) const {
+        stats.seldepth = std::max(stats.seldepth, int(seldepth.get()));
+        stats.nodes += nodes.get();
+        stats.qnodes += qnodes.get();
+        stats.tt_probes += tt_probes.get();
+        stats.tt_hits += tt_hits.get();
+        stats.tt_writes += tt_writes.get();
+        stats.beta_cutoffs += beta_cutoffs.get();
+        stats.first_move_cutoffs += first_move_cutoffs.get();
+    }
+};
+
+/**
+ * Triangular table of principal variations. Row ply holds the best line found
+ * so far from the node being searched at that ply, which is made from the best
+ * move there followed by the row below. Row 0 is the line from the root.
+ */
+struct Pv_table {
+    // A search may reach one ply past max_ply before it stops
+    Move moves[max_ply + 1][max_ply + 1];
+    int length[max_ply + 1];
+
+    void clear(int ply) { length[ply] = ply; }
+
+    void update(int ply, Move move) {
+        moves[ply][ply] = move;
+        for (int i = ply + 1; i < length[ply + 1]; ++i) moves[ply][i] = moves[ply + 1][i];
+        length[ply] = std::max(length[ply + 1], ply + 1);
+    }
+
+    Move_span root_line() const { return {moves[0], std::size_t(length[0])}; }
+};
+
+/**
+ * The state belonging to a single search thread
+ */
+struct Search_thread {
+    Search_thread(const Io& io, Transposition_table& tt, Time_manager& time, bool is_main,
+                  const std::atomic<bool>& abort, Search_history& history)
+        : io{io}, tt{tt}, time{time}, is_main{is_main}, abort{abort}, history{history}
+    {}
+
+    const Io& io;
+    Transposition_table& tt;
+    Time_manager& time;
+    const bool is_main;              // Only the main thread enforces the search limits
+    const std::atomic<bool>& abort;  // Set when helper threads should finish
+
+    // Each thread learns its own move ordering, which may be kept from one
+    // search to the next
+    Search_history& history;
+
+    Thread_stats stats;
+    Pv_table pv;
+    Move_list excluded_root_moves;  // Moves already found by a MultiPV search
+    Move root_move_hint;            // Searched first at the root, instead of the table's move
+    bool completed_iteration = false;
+    bool limit_reached = false;
+
+    /**
+     * Called on entering every node. Every so often, passes the node count on
+     * to the time manager, and checks if the search must stop. The limits
+     * only apply once the first iteration has given a move to play.
+     */
+    void count_node(int ply) {
+        ++stats.nodes;
+        stats.seldepth.raise_to(ply);
+        if (stats.nodes.get() % Time_manager::node_check_interval != 0) return;
+
+        time.add_nodes(Time_manager::node_check_interval);
+        if (is_main && completed_iteration && time.limit_reached()) limit_reached = true;
+    }
+
+    bool stopped() const { return io.stopped() || abort || limit_reached; }
+
+    bool is_excluded_at_root(Move move) const {
+        return std::find(excluded_root_moves.begin(), excluded_root_moves.end(), move) !=
+               excluded_root_moves.end();
+    }
+};
+
+/**
+ * Quiescence search, used at the horizon of the main search so that positions
+ * are only evaluated statically once they are quiet. Only captures and
+ * promotions that don't lose material are searched, and the side to move may
+ * 'stand pat' on the static evaluation rather than make any of them.
+ */
+i16 quiesce(Search_thread& thread, Position& position, int ply, i16 alpha, i16 beta)
 {
-    auto moves = generate_moves(position);
-    if (node && node.key == key) {
-        std::swap(moves[0], moves[node.best_move_position]);
+    thread.count_node(ply);
+    ++thread.stats.qnodes;
+
+    // Standing pat isn't possible when there are no moves at all. Checking for
+    // that costs time at every node, so is only done where it is likely: when in
+    // check, or with only the king and pawns left to move.
+    if ((!has_non_pawn_material(position) || in_check(position)) &&
+        count_legal_moves(position) == 0)
+    {
+        return std::clamp(game_over_score(position, ply), alpha, beta);
     }
-    return moves;
+
+    const i16 stand_pat = invert_if_black(static_evaluate(position), position.active_player);
+
+    if (stand_pat >= beta) return beta;
+    if (stand_pat > alpha) alpha = stand_pat;
+
+    Move_picker picker(position);
+
+    while (const Move move = picker.next()) {
+        if (thread.stopped()) return alpha;
+
+        Applied_move applied(position, move);
+        const auto score = -quiesce(thread, applied.position(), ply + 1, -beta, -alpha);
+
+        if (score >= beta) return beta;
+        if (score > alpha) alpha = score;
+    }
+
+    return alpha;
 }
 
-Recommendation search(const Io& io, const Position& position, u8 depth, i16 alpha, i16 beta,
-                      Transposition_table& tt)
+/**
+ * Principal variation search. The first move is searched with the full
+ * window. Assuming the moves are well ordered, every later move should be
+ * worse, so it is only searched with a null window around alpha, which is
+ * enough to prove that it is worse. If one turns out to be better after all,
+ * it is searched again with the full window to find out by how much.
+ *
+ * Away from the principal variation, the search is also cut short:
+ * - Null move pruning: if passing the turn would still leave us at or above
+ *   beta, assume that some real move would too and fail high after only a
+ *   reduced search. This doesn't hold in zugzwang, so it isn't tried when the
+ *   side to move has only pawns left (where zugzwang is common).
+ * - Late move reductions: quiet moves ordered late are unlikely to be good, so
+ *   they are first searched to a reduced depth, and only searched to the full
+ *   depth if they beat alpha anyway.
+ *
+ * Fails hard: the score returned is always within [alpha, beta].
+ */
+Recommendation search(Search_thread& thread, Position& position, u8 depth, int ply, i16 alpha,
+                      i16 beta, bool allow_null_move = true)
 {
-    if (depth == 0) {
-        return {{}, invert_if_black(static_evaluate(position), position.active_player)};
+    thread.pv.clear(ply);
+
+    if (depth == 0 || ply >= max_ply) {
+        return {{}, quiesce(thread, position, ply, alpha, beta)};
     }
 
-    const auto key = zobrist_hash(position);
-    const auto& node = tt.at(key);
+    thread.count_node(ply);
+
+    const auto key = position.hash;
+    const auto node = thread.tt.probe(key);
+    ++thread.stats.tt_probes;
+    if (node) ++thread.stats.tt_hits;
 
-    // If we've already encountered this exact situation before, we can just return
-    if (node && node.key == key && node.depth >= depth && node.type == Node_type::pv) {
-        return {node.best_move, node.score};
+    // If we've already encountered this situation before, searched at least
+    // as deeply, we may be able to return without searching again. This isn't
+    // done at the root, which must always give a move and principal variation.
+    if (node && ply > 0 && node.depth >= depth) {
+        const i16 score = score_from_table(node.score, ply);
+        switch (node.type) {
+        case Node_type::pv:
+            return {node.best_move, std::clamp(score, alpha, beta)};
+        case Node_type::fail_high:
+            if (score >= beta) return {node.best_move, beta};
+            break;
+        case Node_type::fail_low:
+            if (score <= alpha) return {node.best_move, alpha};
+            break;
+        }
     }
 
-    const auto moves = generate_ordered_moves(position, key, node);
+    const bool is_pv_node = beta - alpha > 1;
+    const bool is_in_check = in_check(position);
+
+    if (allow_null_move && !is_pv_node && !is_in_check && depth >= 2 &&
+        has_non_pawn_material(position) &&
+        invert_if_black(static_evaluate(position), position.active_player) >= beta)
+    {
+        const u8 reduction = depth >= 6 ? 3 : 2;
+        const u8 null_depth = depth - 1 > reduction ? depth - 1 - reduction : 0;
 
-    Move best_move = moves.empty() ? Move{} : moves.front();
-    u8 best_move_position = 0;
+        Applied_null_move applied(position);
+        const auto score = -search(thread, applied.position(), null_depth, ply + 1, -beta,
+                                   -beta + 1, false).score;
+
+        if (thread.stopped()) return {{}, alpha};
+        if (score >= beta) return {{}, beta};
+    }
+
+    const Move tt_move = ply == 0 && thread.root_move_hint ? thread.root_move_hint
+                                                           : node.best_move;
+    Move_picker picker(position, tt_move, thread.history, ply);
+
+    Move best_move;
+    Node_type type = Node_type::fail_low;
+    int num_moves_searched = 0;
 
-    u8 i = 0;
-    for (const auto& move : moves) {
-        if (io.stopped()) return {best_move, alpha};
+    // Quiet moves that failed to cause a cutoff, which lose history score if
+    // a later move does
+    Move quiets_searched[64];
+    int num_quiets_searched = 0;
 
-        const auto new_position = apply(move, position);
-        const auto score = -search(io, new_position, depth - 1, -beta, -alpha, tt).score;
+    while (const Move move = picker.next()) {
+        if (ply == 0 && thread.is_excluded_at_root(move)) continue;
+
+        const Player player = position.active_player;
+        Applied_move applied(position, move);
+        Position& child = applied.position();
+
+        // The table move has only been checked to be pseudo-legal (see Move_picker)
+        if (move == tt_move && in_check(child, player)) continue;
+
+        const bool first_move = !best_move;
+        if (first_move) best_move = move;
+
+        if (thread.stopped()) return {best_move, alpha};
+
+        ++num_moves_searched;
+
+        i16 score;
+        if (first_move) {
+            score = -search(thread, child, depth - 1, ply + 1, -beta, -alpha).score;
+        } else {
+            u8 reduction = 0;
+            if (depth >= 3 && num_moves_searched > 3 && is_quiet(move.info()) &&
+                !is_in_check && !in_check(child))
+            {
+                reduction = num_moves_searched > 6 && depth >= 5 ? 2 : 1;
+            }
+
+            score = -search(thread, child, depth - 1 - reduction, ply + 1, -alpha - 1,
+                            -alpha).score;
+            if (reduction && score > alpha) {
+                score = -search(thread, child, depth - 1, ply + 1, -alpha - 1, -alpha).score;
+            }
+            if (score > alpha && score < beta) {
+                score = -search(thread, child, depth - 1, ply + 1, -beta, -alpha).score;
+            }
+        }
+
+        // Don't let the result of an unfinished search make its way into the table
+        if (thread.stopped()) return {best_move, alpha};
 
         if (score >= beta) {
             alpha = beta;
             best_move = move;
-            best_move_position = i;
+            type = Node_type::fail_high;
+            ++thread.stats.beta_cutoffs;
+            if (first_move) ++thread.stats.first_move_cutoffs;
+            if (is_quiet(move.info())) {
+                const int bonus = depth * depth;
+                thread.history.add_killer(ply, move);
+                thread.history.update_butterfly(player, move, bonus);
+                for (int i = 0; i < num_quiets_searched; ++i) {
+                    thread.history.update_butterfly(player, quiets_searched[i], -bonus);
+                }
+            }
             break;
         }
         if (score > alpha) {
             alpha = score;
             best_move = move;
-            best_move_position = i;
+            type = Node_type::pv;
+            thread.pv.update(ply, move);
+        }
+
+        if (is_quiet(move.info()) && num_quiets_searched < 64) {
+            quiets_searched[num_quiets_searched++] = move;
         }
+    }
 
-        ++i;
+    // No moves at all: checkmate or stalemate
+    if (!best_move && (ply > 0 || thread.excluded_root_moves.empty())) {
+        return {{}, std::clamp(game_over_score(position, ply), alpha, beta)};
     }
 
-    const Node_type type = alpha == beta ? Node_type::fail_high : Node_type::pv;
-    tt.at(key) = Transposition_node{key, best_move, best_move_position, alpha, depth, type};
+    // With moves excluded, the result doesn't hold for the root position itself
+    if (ply > 0 || thread.excluded_root_moves.empty()) {
+        thread.tt.store(Transposition_node{key, best_move, score_to_table(alpha, ply), depth,
+                                           type});
+        ++thread.stats.tt_writes;
+    }
 
     return {best_move, alpha};
 }
 
+/**
+ * Searches the root position with a window around the score expected from the
+ * previous iteration. A narrow window gives more cutoffs, but if the true
+ * score falls outside it, the window is widened on that side and the search
+ * repeated.
+ */
+Recommendation aspiration_search(Search_thread& thread, Position& root, u8 depth, i16 expected)
+{
+    constexpr int initial_margin = 25;
+
+    if (depth < 4) return search(thread, root, depth, 0, -big, +big);
+
+    int margin = initial_margin;
+    i16 alpha = std::max(expected - margin, -big);
+    i16 beta  = std::min(expected + margin, +big);
+
+    while (true) {
+        const auto recommendation = search(thread, root, depth, 0, alpha, beta);
+        if (thread.stopped()) return recommendation;
+
+        if (recommendation.score <= alpha && alpha > -big) {
+            alpha = std::max(alpha - margin, -big);
+        } else if (recommendation.score >= beta && beta < +big) {
+            beta = std::min(beta + margin, +big);
+        } else {
+            return recommendation;
+        }
+        margin *= 2;
+    }
+}
+
+/**
+ * One of the best moves found at the root, with its principal variation
+ */
+struct Root_line {
+    Recommendation recommendation;
+    Move_list pv;
+};
+
+/**
+ * Searches to successively greater depths, starting at first_depth, until
+ * max_depth is reached or the search is stopped. For the main thread, the
+ * time manager may also decide that there isn't time for another iteration.
+ *
+ * In each iteration, the best multipv moves are found one after another, each
+ * time leaving out the moves already found. The later searches are cheap, as
+ * they share the transposition table and move ordering with the earlier ones.
+ *
+ * on_iteration is called with the depth and lines found after each complete
+ * iteration. Returns the lines of the last complete iteration, best first.
+ */
+template <typename F>
+std::vector<Root_line> iterative_deepening(Search_thread& thread, const Position& position,
+                                           u8 first_depth, u8 max_depth, int multipv,
+                                           F&& on_iteration)
+{
+    Position root = position;
+
+    std::vector<Root_line> result;
+    std::vector<Root_line> lines;
+
+    for (u8 depth = first_depth; depth <= max_depth; ++depth) {
+        const auto iteration_start = Time_manager::Clock::now();
+
+        lines.clear();
+        thread.excluded_root_moves = {};
+
+        for (int i = 0; i < multipv; ++i) {
+            // Each line is expected to start with the same move and score about
+            // the same as it did last time
+            thread.root_move_hint = {};
+            i16 expected = result.empty() ? 0 : result.back().recommendation.score;
+            if (std::size_t(i) < result.size()) {
+                thread.root_move_hint = result[i].recommendation.move;
+                expected = result[i].recommendation.score;
+            }
+            const auto recommendation = aspiration_search(thread, root, depth, expected);
+
+            // There is always a line for the best move, even if there is no
+            // move to make
+            if (thread.stopped() || (i > 0 && !recommendation.move)) break;
+
+            Root_line line{recommendation, {}};
+            for (auto move : thread.pv.root_line()) line.pv.push_back(move);
+            if (line.pv.empty() && recommendation.move) line.pv.push_back(recommendation.move);
+
+            lines.push_back(line);
+            thread.excluded_root_moves.push_back(recommendation.move);
+        }
+
+        if (thread.stopped()) break;
+
+        std::stable_sort(lines.begin(), lines.end(), [](const auto& a, const auto& b) {
+            return a.recommendation.score > b.recommendation.score;
+        });
+
+        std::swap(result, lines);
+        thread.completed_iteration = true;
+        on_iteration(depth, result);
+
+        const auto iteration_time = Time_manager::Clock::now() - iteration_start;
+        if (thread.is_main && !thread.time.should_start_iteration(iteration_time)) break;
+    }
+
+    thread.excluded_root_moves = {};
+    thread.root_move_hint = {};
+
+    return result;
+}
+
+/**
+ * Sums the statistics of all the search threads
+ */
+Search_stats collect_stats(const std::vector<std::unique_ptr<Search_thread>>& threads,
+                           const Time_manager& time, int depth)
+{
+    Search_stats stats;
+    stats.depth = depth;
+    for (const auto& thread : threads) thread->stats.add_to(stats);
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(time.elapsed());
+    stats.time = elapsed.count() / 1000;
+    if (elapsed.count() > 0) stats.nps = stats.nodes * 1000000 / elapsed.count();
+
+    return stats;
+}
+
 }  // namespace
 
-void recommend_move(const Io& io, const Position& position, Transposition_table& tt)
+std::vector<Recommendation> run_search(const Io& io, const Position& position,
+                                       Transposition_table& tt, const Search_options& options,
+                                       Span<Search_history*> histories, Thread_pool& helpers)
 {
-    const u8 max_depth = 7;
+    Time_manager time(options, position.active_player);
+    const u8 max_depth = time.max_depth();
 
-    Move best_move;
-    i16 best_score{};
+    tt.new_search();
+
+    // The first thread is the main thread, which runs on this one
+    std::atomic<bool> abort = false;
+    std::vector<std::unique_ptr<Search_thread>> threads;
+    for (std::size_t i = 0; i < histories.size(); ++i) {
+        threads.push_back(
+            std::make_unique<Search_thread>(io, tt, time, i == 0, abort, *histories[i]));
+    }
+
+    // Lazy SMP: helper threads search the same position, sharing only the
+    // transposition table. Half of them start a ply deeper, so that the
+    // threads are spread over different depths. They simply fill the table
+    // with results that the main thread can use, and they finish when the
+    // main thread does, so the main thread alone decides when to stop.
+    for (std::size_t i = 1; i < threads.size(); ++i) {
+        helpers.run(int(i - 1), [&thread = *threads[i], &position, max_depth, i] {
+            iterative_deepening(thread, position, 1 + i % 2, max_depth + 1, 1,
+                                [](u8, const std::vector<Root_line>&) {});
+        });
+    }
+
+    // Statistics are only gathered from the helpers when they are reported, so
+    // that counting costs no more with several threads than with one
+    const auto report_iteration = [&io, &threads, &time](u8 depth,
+                                                         const std::vector<Root_line>& lines) {
+        const Search_stats stats = collect_stats(threads, time, depth);
+        for (const auto& line : lines) {
+            io.report_iteration(depth, line.recommendation.score, line.pv, stats);
+        }
+    };
+
+    const auto lines = iterative_deepening(*threads[0], position, 1, max_depth,
+                                           std::max(options.multipv, 1), report_iteration);
 
-    for (u8 depth = 1; depth <= max_depth; ++depth) {
-        const i16 alpha = -big;
-        const i16 beta  = +big;
-        const auto [move, score] = search(io, position, depth, alpha, beta, tt);
+    abort = true;
+    for (std::size_t i = 1; i < threads.size(); ++i) helpers.wait(int(i - 1));
 
-        if (io.stopped()) break;
+    std::vector<Recommendation> recommendations;
+    for (const auto& line : lines) recommendations.push_back(line.recommendation);
 
-        best_move = move;
-        best_score = score;
+    const Recommendation best = lines.empty() ? Recommendation{} : lines.front().recommendation;
+    io.report_score(best.score);
+    io.report_best_move(best.move);
+
+    return recommendations;
+}
+
+std::vector<Recommendation> recommend_moves(const Io& io, const Position& position,
+                                            Transposition_table& tt,
+                                            const Search_options& options)
+{
+    const int num_threads = std::max(options.threads, 1);
+
+    std::vector<std::unique_ptr<Search_history>> histories;
+    std::vector<Search_history*> history_pointers;
+    for (int i = 0; i < num_threads; ++i) {
+        histories.push_back(std::make_unique<Search_history>());
+        history_pointers.push_back(histories.back().get());
     }
 
-    io.report_score(best_score);
-    io.report_best_move(best_move);
+    Thread_pool helpers(num_threads - 1);
+
+    return run_search(io, position, tt, options, history_pointers, helpers);
 }
 
-}  // namespace Chess
+void recommend_move(const Io& io, const Position& position, Transposition_table& tt,
+                    const Search_options& options)
+{
+    recommend_moves(io, position, tt, options);
+}
 
+}  // namespace Chess
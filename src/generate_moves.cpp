@@ -2,7 +2,18 @@
 #include "chess/position.h"
 #include "chess/move_list.h"
 
+#if defined(CONSTEXPR_TABLES) || defined(STARTUP_TABLES)
+#include "built_lookup_tables.h"
+#else
 #include "lookup_tables.h"
+#endif
+
+#ifdef PEXT
+#ifndef __BMI2__
+#error "Building with -DPEXT needs a target with BMI2, e.g. -march=native on a CPU that has it"
+#endif
+#include <immintrin.h>
+#endif
 
 namespace Chess {
 
@@ -78,13 +89,16 @@ namespace {
 #endif
     Bitboard lookup_moves<Piece::rook>(Location l, Bitboard occupancy_board)
     {
+#ifdef PEXT
+        const auto index = _pext_u64(occupancy_board, attack_lookup_table<Piece::rook>[l]);
+#else
         const Bitboard blockers = attack_lookup_table<Piece::rook>[l] & occupancy_board;
         const Bitboard magic_board = magic_bitboard_lookup_table<Piece::rook>[l];
 
-        constexpr int index_size = 12;
-        const int index = (blockers * magic_board) >> (64 - index_size);
+        const auto index = (blockers * magic_board) >> magic_shift_table<Piece::rook>[l];
+#endif
 
-        return move_lookup_table<Piece::rook>[l][index];
+        return move_lookup_table<Piece::rook>[move_offset_table<Piece::rook>[l] + index];
     }
 
     template <>
@@ -102,13 +116,16 @@ namespace {
 #endif
     Bitboard lookup_moves<Piece::bishop>(Location l, Bitboard occupancy_board)
     {
+#ifdef PEXT
+        const auto index = _pext_u64(occupancy_board, attack_lookup_table<Piece::bishop>[l]);
+#else
         const Bitboard blockers = attack_lookup_table<Piece::bishop>[l] & occupancy_board;
         const Bitboard magic_board = magic_bitboard_lookup_table<Piece::bishop>[l];
 
-        constexpr int index_size = 9;
-        const int index = (blockers * magic_board) >> (64 - index_size);
+        const auto index = (blockers * magic_board) >> magic_shift_table<Piece::bishop>[l];
+#endif
 
-        return move_lookup_table<Piece::bishop>[l][index];
+        return move_lookup_table<Piece::bishop>[move_offset_table<Piece::bishop>[l] + index];
     }
 
     template <>
@@ -142,10 +159,13 @@ struct Extra {
     Bitboard non_king_move_restriction = 0xFFFFFFFFFFFFFFFF;
     Bitboard pawn_move_restriction     = 0xFFFFFFFFFFFFFFFF;
     Bitboard pin_rays[64];
+    Bitboard pinned = 0;  // Locations given a pin ray, which holds all pinned pieces
 
     Bitboard occupancy_board = 0;
 };
 
+}
+
 #ifdef FNOINLINE
 __attribute__ ((noinline))
 #endif
@@ -203,6 +223,8 @@ bool in_check(const Position& position, Player player)
     return attacked & player_king;
 }
 
+namespace {
+
 #ifdef FNOINLINE
 __attribute__ ((noinline))
 #endif
@@ -370,8 +392,8 @@ Extra generate_extra_information(const Position& position)
 
             const u8 c = bit_scan_forward(rook_moves & col[l.col()] & king_rays & col[kl.col()]);
             const u8 r = bit_scan_forward(rook_moves & row[l.row()] & king_rays & row[kl.row()]);
-            if (c < 64) e.pin_rays[c] = col[l.col()];
-            if (r < 64) e.pin_rays[r] = row[l.row()];
+            if (c < 64) { e.pin_rays[c] = col[l.col()]; e.pinned |= mask_of(c); }
+            if (r < 64) { e.pin_rays[r] = row[l.row()]; e.pinned |= mask_of(r); }
         }
 
         for (Bitboard b = opponent_bishops; b; b &= (b - 1)) {
@@ -381,8 +403,8 @@ Extra generate_extra_information(const Position& position)
 
             const u8 fd = bit_scan_forward(bishop_moves & fdiag[l] & king_rays & fdiag[kl]);
             const u8 rd = bit_scan_forward(bishop_moves & rdiag[l] & king_rays & rdiag[kl]);
-            if (fd < 64) e.pin_rays[fd] = fdiag[l];
-            if (rd < 64) e.pin_rays[rd] = rdiag[l];
+            if (fd < 64) { e.pin_rays[fd] = fdiag[l]; e.pinned |= mask_of(fd); }
+            if (rd < 64) { e.pin_rays[rd] = rdiag[l]; e.pinned |= mask_of(rd); }
         }
 
         for (Bitboard b = opponent_queens; b; b &= (b - 1)) {
@@ -394,10 +416,10 @@ Extra generate_extra_information(const Position& position)
             const u8 r  = bit_scan_forward(queen_moves & row[l.row()] & king_rays & row[kl.row()]);
             const u8 fd = bit_scan_forward(queen_moves & fdiag[l] & king_rays & fdiag[kl]);
             const u8 rd = bit_scan_forward(queen_moves & rdiag[l] & king_rays & rdiag[kl]);
-            if (c < 64)  e.pin_rays[c]  = col[l.col()];
-            if (r < 64)  e.pin_rays[r]  = row[l.row()];
-            if (fd < 64) e.pin_rays[fd] = fdiag[l];
-            if (rd < 64) e.pin_rays[rd] = rdiag[l];
+            if (c < 64)  { e.pin_rays[c]  = col[l.col()]; e.pinned |= mask_of(c); }
+            if (r < 64)  { e.pin_rays[r]  = row[l.row()]; e.pinned |= mask_of(r); }
+            if (fd < 64) { e.pin_rays[fd] = fdiag[l]; e.pinned |= mask_of(fd); }
+            if (rd < 64) { e.pin_rays[rd] = rdiag[l]; e.pinned |= mask_of(rd); }
         }
     }
 
@@ -406,6 +428,122 @@ Extra generate_extra_information(const Position& position)
 
 }
 
+// Static exchange evaluation
+namespace {
+
+// Values used for static exchange evaluation, indexed by square
+constexpr int exchange_value[13] = {
+      500,   500,  // Rook
+      300,   300,  // Knight
+      300,   300,  // Bishop
+      900,   900,  // Queen
+    20000, 20000,  // King
+      100,   100,  // Pawn
+        0,         // Empty
+};
+
+/**
+ * Finds all pieces, of both players, attacking a location given the occupancy
+ * board (which may have had pieces removed from it)
+ */
+Bitboard attackers_of(const Position& position, Location l, Bitboard occupancy_board)
+{
+    constexpr static const unsigned right_move_vector_for[2] = {9, 64-7};
+    constexpr static const unsigned left_move_vector_for[2]  = {7, 64-9};
+
+    const auto& bbs = position.bitboard_by_square;
+
+    const Bitboard rooks_and_queens =
+        bbs[*Square::white_rook] | bbs[*Square::black_rook] |
+        bbs[*Square::white_queen] | bbs[*Square::black_queen];
+    const Bitboard bishops_and_queens =
+        bbs[*Square::white_bishop] | bbs[*Square::black_bishop] |
+        bbs[*Square::white_queen] | bbs[*Square::black_queen];
+
+    Bitboard attackers = 0;
+
+    attackers |= lookup_moves<Piece::knight>(l) &
+                 (bbs[*Square::white_knight] | bbs[*Square::black_knight]);
+    attackers |= lookup_moves<Piece::king>(l) &
+                 (bbs[*Square::white_king] | bbs[*Square::black_king]);
+    attackers |= lookup_moves<Piece::rook>(l, occupancy_board) & rooks_and_queens;
+    attackers |= lookup_moves<Piece::bishop>(l, occupancy_board) & bishops_and_queens;
+
+    // A pawn attacks this location if a pawn of the other colour here would attack it
+    for (const Player player : {Player::white, Player::black}) {
+        const Player other = opponent_of(player);
+        const Bitboard left_targets  =
+            rotate_left(mask_of(l), left_move_vector_for[*other])  & ~col[7];
+        const Bitboard right_targets =
+            rotate_left(mask_of(l), right_move_vector_for[*other]) & ~col[0];
+        attackers |= (left_targets | right_targets) & bbs[*player | *Piece::pawn];
+    }
+
+    return attackers & occupancy_board;
+}
+
+}
+
+int static_exchange_evaluation(const Position& position, Move move)
+{
+    const Location from = move.from();
+    const Location to   = move.to();
+
+    // Material gained by the side making each capture in the sequence, assuming
+    // the sequence stops there
+    int gain[32];
+    int d = 0;
+
+    Bitboard occupancy_board = position.bitboard_by_player[0] | position.bitboard_by_player[1];
+
+    int attacker_value = exchange_value[*position.mailbox[from]];
+    gain[0] = exchange_value[*position.mailbox[to]];
+
+    if (move.info() == Move::Info::en_passant_capture) {
+        gain[0] = exchange_value[*Square::white_pawn];
+        occupancy_board &= ~mask_of(Location(to.col(), from.row()));
+    }
+
+    if (is_promotion(move.info())) {
+        const int promotion_value = exchange_value[*promotion_piece(move.info())];
+        gain[0] += promotion_value - exchange_value[*Square::white_pawn];
+        attacker_value = promotion_value;
+    }
+
+    occupancy_board &= ~mask_of(from);
+    Player side = opponent_of(position.active_player);
+
+    while (d < 31) {
+        const Bitboard attackers =
+            attackers_of(position, to, occupancy_board) & position.bitboard_by_player[*side];
+        if (!attackers) break;
+
+        ++d;
+        gain[d] = attacker_value - gain[d - 1];
+
+        // Recapture with the least valuable piece
+        for (const Piece piece : {Piece::pawn, Piece::knight, Piece::bishop, Piece::rook,
+                                  Piece::queen, Piece::king}) {
+            const Bitboard pieces = attackers & position.bitboard_by_square[*piece | *side];
+            if (pieces) {
+                occupancy_board &= ~(pieces & -pieces);
+                attacker_value = exchange_value[*piece];
+                break;
+            }
+        }
+
+        side = opponent_of(side);
+    }
+
+    // Each side may choose to stop capturing if carrying on would be worse
+    while (d > 0) {
+        gain[d - 1] = -std::max(-gain[d - 1], gain[d]);
+        --d;
+    }
+
+    return gain[0];
+}
+
 // Add moves to move list functions
 namespace {
 
@@ -428,7 +566,8 @@ void add_legal_king_moves(u8 begin, Bitboard targets, const Position& position,
     }
 }
 
-void add_legal_castles(const Position& position, const Extra& extra, Move_list& moves)
+template <typename Moves>
+void add_legal_castles(const Position& position, const Extra& extra, Moves& moves)
 {
     constexpr Location king_location_for[2] = {"e1", "e8"};
     constexpr Location kingside_destination_for[2] = {"g1", "g8"};
@@ -522,20 +661,94 @@ void add_legal_pawn_promotions(unsigned vector, Bitboard targets, const Extra& e
     }
 }
 
+/**
+ * Stands in for a move list when the moves only need to be counted. The add
+ * functions are overloaded for it to count whole target sets at once, so only
+ * the few moves added one at a time (castles) go through emplace_back.
+ */
+struct Move_count {
+    int n = 0;
+
+    void emplace_back(Location, Location, Move::Info) { ++n; }
+};
+
+void add_legal_king_moves(u8, Bitboard targets, const Position&, const Extra& extra,
+                          Move_count& moves)
+{
+    moves.n += count(targets & ~extra.attacked_by_opponent);
+}
+
+void add_legal_non_king_moves(u8 begin, Bitboard targets, const Position&, const Extra& extra,
+                              Move_count& moves)
+{
+    moves.n += count(targets & extra.non_king_move_restriction & extra.pin_rays[begin]);
+}
+
+void add_legal_pawn_moves(unsigned vector, Bitboard targets, const Extra& extra, Move::Info,
+                          Move_count& moves)
+{
+    targets &= extra.pawn_move_restriction;
+
+    // Only the targets of pinned pawns need checking one by one
+    const Bitboard pinned_targets = targets & rotate_left(extra.pinned, vector % 64);
+    moves.n += count(targets & ~pinned_targets);
+
+    for (Bitboard b = pinned_targets; b; b &= (b - 1)) {
+        const Location end = bit_scan_forward(b);
+        const Location begin = u8(end - vector) % 64;
+
+        if (mask_of(end) & extra.pin_rays[begin]) ++moves.n;
+    }
+}
+
+void add_legal_pawn_promotions(unsigned vector, Bitboard targets, const Extra& extra,
+                               Move::Info info, Move_count& moves)
+{
+    Move_count pawn_moves;
+    add_legal_pawn_moves(vector, targets, extra, info, pawn_moves);
+    moves.n += 4 * pawn_moves.n;
+}
+
 }
 
 // Move generation functions
 namespace {
 
+/**
+ * Which moves a generation function should produce. Promotions are counted
+ * alongside captures.
+ */
+enum class Move_kind {
+    all,
+    captures,
+    quiets,
+};
+
+template <Move_kind kind>
+Bitboard possible_targets_for(const Position& position)
+{
+    const auto player = position.active_player;
+
+    switch (kind) {
+    case Move_kind::captures:
+        return position.bitboard_by_player[*opponent_of(player)];
+    case Move_kind::quiets:
+        return ~(position.bitboard_by_player[0] | position.bitboard_by_player[1]);
+    case Move_kind::all: default:
+        return ~position.bitboard_by_player[*player];
+    }
+}
+
+template <Move_kind kind, typename Moves>
 #ifdef FNOINLINE
 __attribute__ ((noinline))
 #endif
-void generate_king_moves(const Position& position, const Extra& extra, Move_list& moves)
+void generate_king_moves(const Position& position, const Extra& extra, Moves& moves)
 {
     const auto player = position.active_player;
     Bitboard kings = position.bitboard_by_square[*player | *Piece::king];
 
-    const Bitboard possible_targets = ~position.bitboard_by_player[*player];
+    const Bitboard possible_targets = possible_targets_for<kind>(position);
 
     assert(kings && "There must be a king on the board, always");
 
@@ -543,18 +756,19 @@ void generate_king_moves(const Position& position, const Extra& extra, Move_list
     const Bitboard targets = lookup_moves<Piece::king>(begin) & possible_targets;
     add_legal_king_moves(begin, targets, position, extra, moves);
 
-    add_legal_castles(position, extra, moves);
+    if (kind != Move_kind::captures) add_legal_castles(position, extra, moves);
 }
 
+template <Move_kind kind, typename Moves>
 #ifdef FNOINLINE
 __attribute__ ((noinline))
 #endif
-void generate_knight_moves(const Position& position, const Extra& extra, Move_list& moves)
+void generate_knight_moves(const Position& position, const Extra& extra, Moves& moves)
 {
     const auto player = position.active_player;
     Bitboard knights = position.bitboard_by_square[*player | *Piece::knight];
 
-    const Bitboard possible_targets = ~position.bitboard_by_player[*player];
+    const Bitboard possible_targets = possible_targets_for<kind>(position);
 
     while (knights) {
         const u8 begin = bit_scan_forward(knights);
@@ -564,18 +778,18 @@ void generate_knight_moves(const Position& position, const Extra& extra, Move_li
     }
 }
 
-template <Piece piece,
+template <Piece piece, Move_kind kind, typename Moves,
           typename = std::enable_if_t<piece == Piece::rook || piece == Piece::bishop ||
                                       piece == Piece::queen>>
 #ifdef FNOINLINE
 __attribute__ ((noinline))
 #endif
-void generate_sliding_moves(const Position& position, const Extra& extra, Move_list& moves)
+void generate_sliding_moves(const Position& position, const Extra& extra, Moves& moves)
 {
     const auto player = position.active_player;
     Bitboard pieces = position.bitboard_by_square[*player | *piece];
 
-    const Bitboard possible_targets = ~position.bitboard_by_player[*player];
+    const Bitboard possible_targets = possible_targets_for<kind>(position);
 
     const Bitboard occupancy_board =
         position.bitboard_by_player[0] | position.bitboard_by_player[1];
@@ -588,10 +802,11 @@ void generate_sliding_moves(const Position& position, const Extra& extra, Move_l
     }
 }
 
+template <typename Moves>
 #ifdef FNOINLINE
 __attribute__ ((noinline))
 #endif
-void generate_pawn_captures(const Position& position, const Extra& extra, Move_list& moves)
+void generate_pawn_captures(const Position& position, const Extra& extra, Moves& moves)
 {
     const auto player = position.active_player;
 
@@ -655,10 +870,11 @@ void generate_pawn_captures(const Position& position, const Extra& extra, Move_l
     }
 }
 
+template <Move_kind kind, typename Moves>
 #ifdef FNOINLINE
 __attribute__ ((noinline))
 #endif
-void generate_pawn_pushes(const Position& position, const Extra& extra, Move_list& moves)
+void generate_pawn_pushes(const Position& position, const Extra& extra, Moves& moves)
 {
     const auto player = position.active_player;
 
@@ -683,11 +899,15 @@ void generate_pawn_pushes(const Position& position, const Extra& extra, Move_lis
         rotate_left(pawns, move_vector) & empty & promotion_row;
 
     // Action happening here
-    add_legal_pawn_moves(move_vector, single_push_targets, extra, Move::Info::normal, moves);
-    add_legal_pawn_moves(move_vector * 2, double_push_targets, extra, Move::Info::double_pawn_push,
-                         moves);
-    add_legal_pawn_promotions(move_vector, promotion_targets, extra, Move::Info::normal_promotion,
-                              moves);
+    if (kind != Move_kind::captures) {
+        add_legal_pawn_moves(move_vector, single_push_targets, extra, Move::Info::normal, moves);
+        add_legal_pawn_moves(move_vector * 2, double_push_targets, extra,
+                             Move::Info::double_pawn_push, moves);
+    }
+    if (kind != Move_kind::quiets) {
+        add_legal_pawn_promotions(move_vector, promotion_targets, extra,
+                                  Move::Info::normal_promotion, moves);
+    }
 }
 
 }
@@ -698,19 +918,75 @@ Move_list generate_moves(const Position& position)
 
     const Extra e = generate_extra_information(position);
 
-    generate_king_moves(position, e, moves);
+    generate_king_moves<Move_kind::all>(position, e, moves);
 
-    generate_pawn_pushes(position, e, moves);
+    generate_pawn_pushes<Move_kind::all>(position, e, moves);
     generate_pawn_captures(position, e, moves);
 
-    generate_knight_moves(position, e, moves);
-    generate_sliding_moves<Piece::rook  >(position, e, moves);
-    generate_sliding_moves<Piece::bishop>(position, e, moves);
-    generate_sliding_moves<Piece::queen >(position, e, moves);
+    generate_knight_moves<Move_kind::all>(position, e, moves);
+    generate_sliding_moves<Piece::rook,   Move_kind::all>(position, e, moves);
+    generate_sliding_moves<Piece::bishop, Move_kind::all>(position, e, moves);
+    generate_sliding_moves<Piece::queen,  Move_kind::all>(position, e, moves);
 
     return moves;
 }
 
+Move_list generate_captures(const Position& position)
+{
+    Move_list moves;
+
+    const Extra e = generate_extra_information(position);
+
+    generate_king_moves<Move_kind::captures>(position, e, moves);
+
+    generate_pawn_pushes<Move_kind::captures>(position, e, moves);
+    generate_pawn_captures(position, e, moves);
+
+    generate_knight_moves<Move_kind::captures>(position, e, moves);
+    generate_sliding_moves<Piece::rook,   Move_kind::captures>(position, e, moves);
+    generate_sliding_moves<Piece::bishop, Move_kind::captures>(position, e, moves);
+    generate_sliding_moves<Piece::queen,  Move_kind::captures>(position, e, moves);
+
+    return moves;
+}
+
+Move_list generate_quiet_moves(const Position& position)
+{
+    Move_list moves;
+
+    const Extra e = generate_extra_information(position);
+
+    generate_king_moves<Move_kind::quiets>(position, e, moves);
+
+    generate_pawn_pushes<Move_kind::quiets>(position, e, moves);
+
+    generate_knight_moves<Move_kind::quiets>(position, e, moves);
+    generate_sliding_moves<Piece::rook,   Move_kind::quiets>(position, e, moves);
+    generate_sliding_moves<Piece::bishop, Move_kind::quiets>(position, e, moves);
+    generate_sliding_moves<Piece::queen,  Move_kind::quiets>(position, e, moves);
+
+    return moves;
+}
+
+int count_legal_moves(const Position& position)
+{
+    Move_count moves;
+
+    const Extra e = generate_extra_information(position);
+
+    generate_king_moves<Move_kind::all>(position, e, moves);
+
+    generate_pawn_pushes<Move_kind::all>(position, e, moves);
+    generate_pawn_captures(position, e, moves);
+
+    generate_knight_moves<Move_kind::all>(position, e, moves);
+    generate_sliding_moves<Piece::rook,   Move_kind::all>(position, e, moves);
+    generate_sliding_moves<Piece::bishop, Move_kind::all>(position, e, moves);
+    generate_sliding_moves<Piece::queen,  Move_kind::all>(position, e, moves);
+
+    return moves.n;
+}
+
 bool is_legal_move(Move move, const Position& position)
 {
     const auto moves = generate_moves(position);
@@ -718,5 +994,77 @@ bool is_legal_move(Move move, const Position& position)
     return std::find(moves.begin(), moves.end(), move) != moves.end();
 }
 
+bool is_pseudo_legal_move(Move move, const Position& position)
+{
+    constexpr static const unsigned right_move_vector_for[2] = {9, 64-7};
+    constexpr static const unsigned left_move_vector_for[2]  = {7, 64-9};
+    constexpr static const unsigned move_vector_for[2]       = {8, 64-8};
+    constexpr static const Bitboard second_row_for[2]        = {row[1], row[6]};
+    constexpr static const Bitboard promotion_row_for[2]     = {row[7], row[0]};
+
+    const Player player = position.active_player;
+    const Player opponent = opponent_of(player);
+    const Location from = move.from();
+    const Location to = move.to();
+    const Move::Info info = move.info();
+
+    const Square moving = position.mailbox[from];
+    if (!is_square_owned_by_player(moving, player)) return false;
+    if (is_square_owned_by_player(position.mailbox[to], player)) return false;
+
+    const Bitboard occupancy_board =
+        position.bitboard_by_player[0] | position.bitboard_by_player[1];
+    const bool captures = is_square_owned_by_player(position.mailbox[to], opponent);
+    const Piece piece = to_piece(moving);
+
+    if (info == Move::Info::kingside_castle || info == Move::Info::queenside_castle) {
+        // Castles are rare enough as table moves to be checked in full
+        if (piece != Piece::king) return false;
+        Move_list castles;
+        add_legal_castles(position, generate_extra_information(position), castles);
+        return std::find(castles.begin(), castles.end(), move) != castles.end();
+    }
+
+    if (piece != Piece::pawn) {
+        Bitboard targets = 0;
+        switch (piece) {
+        case Piece::rook:   targets = lookup_moves<Piece::rook>(from, occupancy_board);   break;
+        case Piece::knight: targets = lookup_moves<Piece::knight>(from);                  break;
+        case Piece::bishop: targets = lookup_moves<Piece::bishop>(from, occupancy_board); break;
+        case Piece::queen:  targets = lookup_moves<Piece::queen>(from, occupancy_board);  break;
+        case Piece::king:   targets = lookup_moves<Piece::king>(from);                    break;
+        default: break;
+        }
+        const auto expected = captures ? Move::Info::normal_capture : Move::Info::normal;
+        return (targets & mask_of(to)) && info == expected;
+    }
+
+    const Bitboard pawn = mask_of(from);
+    const Bitboard diagonals = (rotate_left(pawn, left_move_vector_for[*player])  & ~col[7]) |
+                               (rotate_left(pawn, right_move_vector_for[*player]) & ~col[0]);
+    const bool promotes = mask_of(to) & promotion_row_for[*player];
+
+    if (info == Move::Info::en_passant_capture) {
+        return position.en_passant_target != "a1" && to == position.en_passant_target &&
+               (diagonals & mask_of(to));
+    }
+    if (info == Move::Info::double_pawn_push) {
+        const Bitboard single = rotate_left(pawn, move_vector_for[*player]);
+        const Bitboard double_ = rotate_left(single, move_vector_for[*player]);
+        return (pawn & second_row_for[*player]) && !(single & occupancy_board) &&
+               (double_ & mask_of(to) & ~occupancy_board);
+    }
+    const Bitboard targets = captures ? diagonals : rotate_left(pawn, move_vector_for[*player]);
+    const bool info_matches = promotes ? is_promotion(info) && is_capture(info) == captures
+                                       : info == (captures ? Move::Info::normal_capture
+                                                           : Move::Info::normal);
+    return info_matches && (targets & mask_of(to));
+}
+
+bool in_check(const Position& position)
+{
+    return in_check(position, position.active_player);
+}
+
 }  // namespace Chess
 
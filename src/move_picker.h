@@ -0,0 +1,255 @@
+#pragma once
+
+#include "chess/generate_moves.h"
+#include "chess/move_list.h"
+#include "chess/position.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <utility>
+
+namespace Chess {
+
+constexpr int max_ply = 128;
+
+/**
+ * What a search thread has learnt about which quiet moves tend to be good,
+ * used to order quiet moves. This consists of killer moves, the quiet moves
+ * that most recently caused a cutoff at each ply, and a 'butterfly' history
+ * table that scores each quiet move by its from and to locations according to
+ * how often it has caused cutoffs elsewhere in the tree.
+ */
+struct Search_history {
+    static constexpr int history_max = 1 << 14;
+
+    Move killers[max_ply][2] = {};
+    int butterfly[2][64][64] = {};
+
+    void add_killer(int ply, Move move) {
+        if (move == killers[ply][0]) return;
+        killers[ply][1] = killers[ply][0];
+        killers[ply][0] = move;
+    }
+
+    /**
+     * Adjusts the history score of a move. Scores move part of the way
+     * towards +/-history_max, so they can never overflow and newer results
+     * count for more than older ones.
+     */
+    void update_butterfly(Player player, Move move, int bonus) {
+        int& score = butterfly[*player][move.from()][move.to()];
+        score += bonus - score * std::abs(bonus) / history_max;
+    }
+
+    int butterfly_score(Player player, Move move) const {
+        return butterfly[*player][move.from()][move.to()];
+    }
+
+    /**
+     * Prepares the history kept from one search for use in the next. Killer
+     * moves belong to the plies of the last search, so are forgotten, while
+     * history scores are halved so that newer results count for more.
+     */
+    void age() {
+        for (auto& ply_killers : killers) ply_killers[0] = ply_killers[1] = Move();
+        for (auto& player_scores : butterfly) {
+            for (auto& from_scores : player_scores) {
+                for (int& score : from_scores) score /= 2;
+            }
+        }
+    }
+};
+
+/**
+ * Hands out the moves of a position one at a time, in the order in which they
+ * should be searched. Moves are generated in stages, and a stage is only
+ * generated once the one before it has run out. If an early move causes a
+ * cutoff, later stages are never generated at all.
+ *
+ * The stages are:
+ * 1. The best move from the transposition table, if pseudo-legal
+ * 2. Captures and promotions that don't lose material, most valuable victim
+ *    first and then least valuable attacker first
+ * 3. Quiet moves, killer moves first and then by history score
+ * 4. Captures that lose material according to static exchange evaluation
+ *
+ * Killer moves come from other positions, so they are only trusted once they
+ * have been found amongst the quiet moves of this one.
+ *
+ * For quiescence search, only the second stage is used.
+ */
+class Move_picker {
+public:
+    Move_picker(const Position& position, Move tt_move, const Search_history& history, int ply)
+        : position_{position}, history_{&history}, ply_{ply}
+    {
+        // Two positions may share a hash, so the move may not belong to this
+        // one. Only a cheap check is made here, and whether the move leaves our
+        // king in check is left to the search, once the move has been made.
+        if (tt_move && is_pseudo_legal_move(tt_move, position)) tt_move_ = tt_move;
+    }
+
+    // Only picks captures and promotions that don't lose material
+    explicit Move_picker(const Position& position)
+        : position_{position}, stage_{Stage::generate_captures}, quiescence_{true}
+    {}
+
+    /**
+     * Returns the next move to search, or a null move once there are none left
+     */
+    Move next() {
+        while (true) {
+            switch (stage_) {
+            case Stage::tt_move:
+                stage_ = Stage::generate_captures;
+                if (tt_move_) return tt_move_;
+                break;
+            case Stage::generate_captures:
+                moves_ = generate_captures(position_);
+                index_ = 0;
+                this->score_captures();
+                stage_ = Stage::good_captures;
+                break;
+            case Stage::good_captures:
+                if (const Move move = this->next_good_capture()) return move;
+                stage_ = quiescence_ ? Stage::done : Stage::generate_quiets;
+                break;
+            case Stage::generate_quiets:
+                moves_ = generate_quiet_moves(position_);
+                index_ = 0;
+                this->score_quiets();
+                stage_ = Stage::quiets;
+                break;
+            case Stage::quiets:
+                if (const Move move = this->next_quiet()) return move;
+                moves_ = bad_captures_;
+                index_ = 0;
+                stage_ = Stage::bad_captures;
+                break;
+            case Stage::bad_captures:
+                if (const Move move = this->next_from_list()) return move;
+                stage_ = Stage::done;
+                break;
+            case Stage::done:
+                return {};
+            }
+        }
+    }
+private:
+    enum class Stage : u8 {
+        tt_move,
+        generate_captures,
+        good_captures,
+        generate_quiets,
+        quiets,
+        bad_captures,
+        done,
+    };
+
+    // Piece values in pawns for ordering captures, indexed by square. Kings
+    // only ever appear as attackers, so are valued last amongst those.
+    static constexpr int mvv_lva_value[13] = {5, 5, 3, 3, 3, 3, 9, 9, 10, 10, 1, 1, 0};
+
+    int victim_value(Move move) const {
+        int value = move.info() == Move::Info::en_passant_capture
+                        ? mvv_lva_value[*Square::white_pawn]
+                        : mvv_lva_value[*position_.mailbox[move.to()]];
+        if (is_promotion(move.info())) {
+            value += mvv_lva_value[*promotion_piece(move.info())] -
+                     mvv_lva_value[*Square::white_pawn];
+        }
+        return value;
+    }
+
+    int attacker_value(Move move) const {
+        return mvv_lva_value[*position_.mailbox[move.from()]];
+    }
+
+    void score_captures() {
+        for (std::size_t i = 0; i < moves_.size(); ++i) {
+            scores_[i] = 16 * this->victim_value(moves_[i]) - this->attacker_value(moves_[i]);
+        }
+    }
+
+    void score_quiets() {
+        const auto& killers = history_->killers[ply_];
+        const Player player = position_.active_player;
+
+        for (std::size_t i = 0; i < moves_.size(); ++i) {
+            if (moves_[i] == killers[0]) {
+                scores_[i] = Search_history::history_max + 2;
+            } else if (moves_[i] == killers[1]) {
+                scores_[i] = Search_history::history_max + 1;
+            } else {
+                scores_[i] = history_->butterfly_score(player, moves_[i]);
+            }
+        }
+    }
+
+    /**
+     * Swaps the highest scoring of the remaining moves into the next place in
+     * the list, and returns it
+     */
+    Move pick_best() {
+        std::size_t best = index_;
+        for (std::size_t i = index_ + 1; i < moves_.size(); ++i) {
+            if (scores_[i] > scores_[best]) best = i;
+        }
+        std::swap(moves_[index_], moves_[best]);
+        std::swap(scores_[index_], scores_[best]);
+
+        return moves_[index_++];
+    }
+
+    /**
+     * Selects the highest scoring of the remaining captures. Any that lose
+     * material are set aside to be searched last (or not at all in quiescence).
+     */
+    Move next_good_capture() {
+        while (index_ < moves_.size()) {
+            const Move move = this->pick_best();
+            if (move == tt_move_) continue;
+
+            // A capture can only lose material if the attacker is worth more
+            if (this->attacker_value(move) > this->victim_value(move) &&
+                static_exchange_evaluation(position_, move) < 0)
+            {
+                if (!quiescence_) bad_captures_.push_back(move);
+                continue;
+            }
+
+            return move;
+        }
+        return {};
+    }
+
+    Move next_quiet() {
+        while (index_ < moves_.size()) {
+            const Move move = this->pick_best();
+            if (!(move == tt_move_)) return move;
+        }
+        return {};
+    }
+
+    Move next_from_list() {
+        while (index_ < moves_.size()) {
+            const Move move = moves_[index_++];
+            if (!(move == tt_move_)) return move;
+        }
+        return {};
+    }
+
+    const Position& position_;
+    const Search_history* history_ = nullptr;
+    int ply_ = 0;
+    Move tt_move_;
+
+    Stage stage_ = Stage::tt_move;
+    bool quiescence_ = false;
+    Move_list moves_;
+    int scores_[256];
+    std::size_t index_ = 0;
+    Move_list bad_captures_;
+};
+
+}  // namespace Chess
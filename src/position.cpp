@@ -1,7 +1,7 @@
 #include "chess/position.h"
 #include "chess/misc.h"
+#include "piece_square_tables.h"
 
-#include <random>
 #include <array>
 
 namespace Chess {
@@ -195,6 +195,8 @@ Position Position::from_fen(const std::string& fen_str)
         parse_rest_of_fen(it, fen_str.end(), position);
     }
     fill_bitboards_from_mailbox(position);
+    position.hash = zobrist_hash(position);
+    position.score = piece_square_score(position);
 
     return position;
 }
@@ -209,30 +211,148 @@ std::string to_fen(const Position& position)
     return fen;
 }
 
-Position apply(Move move, Position position)
-{
+namespace {
+
+    /**
+     * A splitmix64 generator, which can run at compile time
+     */
+    struct Random_u64 {
+        u64 state = 0;
+
+        constexpr u64 operator()() {
+            u64 z = (state += 0x9e3779b97f4a7c15);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+            return z ^ (z >> 31);
+        }
+    };
+
+    /**
+     * Random numbers used to build Zobrist hashes. Empty squares are given a
+     * key of zero so that they can be ignored when updating hashes.
+     */
+    struct Zobrist_keys {
+        std::array<std::array<u64, 13>, 64> board;
+        std::array<u64, 16> castling;  // Indexed by white rights | black rights << 2
+        std::array<u64, 8> en_passant_col;
+        u64 black_to_move;
+    };
+
+    // Built by the compiler, so that positions made while globals are being
+    // initialised get the same hashes as any other
+    constexpr Zobrist_keys zobrist_keys = [] {
+        Random_u64 random_u64;
+        Zobrist_keys keys{};
+
+        for (auto& i : keys.board) {
+            for (auto& j : i) j = random_u64();
+            i[*Square::empty] = 0;
+        }
+
+        std::array<u64, 4> random_castling_rights{};
+        for (auto& i : random_castling_rights) i = random_u64();
+        for (int i = 0; i < 16; ++i) {
+            keys.castling[i] = 0;
+            for (int bit = 0; bit < 4; ++bit) {
+                if (i & (1 << bit)) keys.castling[i] ^= random_castling_rights[bit];
+            }
+        }
+
+        for (auto& i : keys.en_passant_col) i = random_u64();
+        keys.black_to_move = random_u64();
+
+        return keys;
+    }();
+
+    u64 castling_key(const Castle_rights (&castling)[2])
+    {
+        return zobrist_keys.castling[*castling[0] | (*castling[1] << 2)];
+    }
+
+    u64 en_passant_key(Location en_passant_target)
+    {
+        if (en_passant_target == "a1") return 0;
+        return zobrist_keys.en_passant_col[en_passant_target.col()];
+    }
+
     constexpr Location rook_locations_for_player[2][2] = {{"a1", "h1"}, {"a8", "h8"}};
     constexpr Location king_location_for_player[2] = {"e1", "e8"};
     constexpr int forward_vector_for_player[2] = {8, -8};
 
+    void remove_piece(Position& position, Location l)
+    {
+        const Square square = position.mailbox[l];
+        const Bitboard mask = mask_of(l);
+
+        assert(square != Square::empty);
+
+        position.bitboard_by_square[*square] &= ~mask;
+        position.bitboard_by_player[*square & 1] &= ~mask;
+        position.mailbox[l] = Square::empty;
+        position.hash ^= zobrist_keys.board[l][*square];
+        position.score -= piece_square_values[*square][l];
+    }
+
+    void place_piece(Position& position, Location l, Square square)
+    {
+        const Bitboard mask = mask_of(l);
+
+        assert(position.mailbox[l] == Square::empty);
+
+        position.bitboard_by_square[*square] |= mask;
+        position.bitboard_by_player[*square & 1] |= mask;
+        position.mailbox[l] = square;
+        position.hash ^= zobrist_keys.board[l][*square];
+        position.score += piece_square_values[*square][l];
+    }
+
+    void move_piece(Position& position, Location from, Location to)
+    {
+        const Square square = position.mailbox[from];
+        remove_piece(position, from);
+        place_piece(position, to, square);
+    }
+
+}
+
+Position apply(Move move, Position position)
+{
+    make_move(position, move);
+    return position;
+}
+
+Undo_info make_move(Position& position, Move move)
+{
     const Player player = position.active_player;
     const Player opponent = opponent_of(player);
 
-    const Location from      = move.from();
-    const Location to        = move.to();
-    const Bitboard from_mask = mask_of(from);
-    const Bitboard to_mask   = mask_of(to);
+    const Location from = move.from();
+    const Location to   = move.to();
     const Square from_square = position.mailbox[from];
     const Square to_square   = position.mailbox[to];
 
+    const Undo_info undo{to_square,
+                         {position.castling[0], position.castling[1]},
+                         position.en_passant_target,
+                         position.halfmove_clock,
+                         position.fullmove_number,
+                         position.hash};
+
+    // Hash out the old castling rights and en passant target, the new ones are
+    // hashed in at the end
+    position.hash ^= castling_key(position.castling);
+    position.hash ^= en_passant_key(position.en_passant_target);
+
 // Move the pieces involved
 
-    position.bitboard_by_square[*from_square] &= ~from_mask;  // Remove from square at old location
-    position.bitboard_by_square[*to_square]   &= ~to_mask;    // Remove to square at new location
-    position.bitboard_by_square[*from_square] |= to_mask;     // Move from square at new location
+    if (to_square != Square::empty) remove_piece(position, to);
+    remove_piece(position, from);
 
-    position.mailbox[to] = from_square;
-    position.mailbox[from] = Square::empty;
+    if (is_promotion(move.info())) {
+        place_piece(position, to, Square(*promotion_piece(move.info()) | *player));
+    } else {
+        place_piece(position, to, from_square);
+    }
 
 // Reset the en passant target
 
@@ -256,51 +376,22 @@ Position apply(Move move, Position position)
 
 // Deal with move information
 
-    if (is_promotion(move.info())) {
-        const Square promotion_square = Square(*promotion_piece(move.info()) | *player);
-
-        position.mailbox[to] = promotion_square;
-
-        position.bitboard_by_square[*from_square] &= ~to_mask;
-        position.bitboard_by_square[*promotion_square] |= to_mask;
-    }
-
     if (move.info() == Move::Info::double_pawn_push) {
         position.en_passant_target = to - forward_vector_for_player[*player];
     }
 
     if (move.info() == Move::Info::kingside_castle) {
-        position.mailbox[to - 1] = Square(*Piece::rook | *player);
-        position.mailbox[rook_locations_for_player[*player][1]] = Square::empty;
-
-        position.bitboard_by_square[*Piece::rook | *player] |= mask_of(to - 1);
-        position.bitboard_by_square[*Piece::rook | *player] &=
-            ~mask_of(rook_locations_for_player[*player][1]);
+        move_piece(position, rook_locations_for_player[*player][1], to - 1);
     }
 
     if (move.info() == Move::Info::queenside_castle) {
-        position.mailbox[to + 1] = Square(*Piece::rook | *player);
-        position.mailbox[rook_locations_for_player[*player][0]] = Square::empty;
-
-        position.bitboard_by_square[*Piece::rook | *player] |= mask_of(to + 1);
-        position.bitboard_by_square[*Piece::rook | *player] &=
-            ~mask_of(rook_locations_for_player[*player][0]);
+        move_piece(position, rook_locations_for_player[*player][0], to + 1);
     }
 
     if (move.info() == Move::Info::en_passant_capture) {
-        const Location location_of_taken_pawn = to - forward_vector_for_player[*player];
-
-        position.mailbox[location_of_taken_pawn] = Square::empty;
-
-        position.bitboard_by_square[*Piece::pawn | *opponent] &= ~mask_of(location_of_taken_pawn);
+        remove_piece(position, to - forward_vector_for_player[*player]);
     }
 
-// Update other bitboards
-
-    const auto& bbs = position.bitboard_by_square;
-    position.bitboard_by_player[0] = bbs[0] | bbs[2] | bbs[4] | bbs[6] | bbs[8] | bbs[10];
-    position.bitboard_by_player[1] = bbs[1] | bbs[3] | bbs[5] | bbs[7] | bbs[9] | bbs[11];
-
 // Update other pieces of information
 
     if (player == Player::black) position.fullmove_number++;
@@ -309,50 +400,109 @@ Position apply(Move move, Position position)
 
     position.active_player = opponent;
 
-    return position;
+    position.hash ^= castling_key(position.castling);
+    position.hash ^= en_passant_key(position.en_passant_target);
+    position.hash ^= zobrist_keys.black_to_move;
+
+    return undo;
+}
+
+void unmake_move(Position& position, Move move, const Undo_info& undo)
+{
+    const Player player = opponent_of(position.active_player);
+    const Player opponent = position.active_player;
+
+    const Location from = move.from();
+    const Location to   = move.to();
+
+// Put the pieces involved back
+
+    const Square moved_square = is_promotion(move.info()) ? Square(*Piece::pawn | *player)
+                                                          : position.mailbox[to];
+
+    remove_piece(position, to);
+    place_piece(position, from, moved_square);
+
+    if (undo.captured != Square::empty) place_piece(position, to, undo.captured);
+
+// Deal with move information
+
+    if (move.info() == Move::Info::kingside_castle) {
+        move_piece(position, to - 1, rook_locations_for_player[*player][1]);
+    }
+
+    if (move.info() == Move::Info::queenside_castle) {
+        move_piece(position, to + 1, rook_locations_for_player[*player][0]);
+    }
+
+    if (move.info() == Move::Info::en_passant_capture) {
+        place_piece(position, to - forward_vector_for_player[*player],
+                    Square(*Piece::pawn | *opponent));
+    }
+
+// Restore other pieces of information
+
+    position.castling[0] = undo.castling[0];
+    position.castling[1] = undo.castling[1];
+    position.en_passant_target = undo.en_passant_target;
+    position.halfmove_clock = undo.halfmove_clock;
+    position.fullmove_number = undo.fullmove_number;
+    position.hash = undo.hash;
+    position.active_player = player;
 }
 
-u64 random_u64()
+Undo_info make_null_move(Position& position)
 {
-    static std::mt19937_64 gen{0};
-    return gen();
+    const Undo_info undo{Square::empty,
+                         {position.castling[0], position.castling[1]},
+                         position.en_passant_target,
+                         position.halfmove_clock,
+                         position.fullmove_number,
+                         position.hash};
+
+    position.hash ^= en_passant_key(position.en_passant_target);
+    position.hash ^= zobrist_keys.black_to_move;
+
+    position.en_passant_target = "a1";
+    position.active_player = opponent_of(position.active_player);
+
+    return undo;
 }
 
-u64 zobrist_hash(const Position& position)
+void unmake_null_move(Position& position, const Undo_info& undo)
 {
-    static const auto random_board = [] {
-        std::array<std::array<u64, 13>, 64> array;
-        for (auto& i : array) for (auto& j : i) j = random_u64();
-        return array;
-    }();
-    static const auto random_castling_rights = [] {
-        std::array<u64, 4> array;
-        for (auto& i : array) i = random_u64();
-        return array;
-    }();
-    static const auto random_en_passant_col = [] {
-        std::array<u64, 8> array;
-        for (auto& i : array) i = random_u64();
-        return array;
-    }();
-    static const u64 random_black_to_move = random_u64();
+    position.en_passant_target = undo.en_passant_target;
+    position.hash = undo.hash;
+    position.active_player = opponent_of(position.active_player);
+}
 
+u64 zobrist_hash(const Position& position)
+{
     u64 value = 0;
 
     for (int i = 0; i < 64; ++i) {
-        value ^= random_board[i][*position.mailbox[i]];
-    }
-    value ^= (can_castle_kingside (position.castling[0]) * random_castling_rights[0]);
-    value ^= (can_castle_queenside(position.castling[0]) * random_castling_rights[1]);
-    value ^= (can_castle_kingside (position.castling[1]) * random_castling_rights[3]);
-    value ^= (can_castle_queenside(position.castling[1]) * random_castling_rights[4]);
-    if (position.en_passant_target != "a1") {
-        value ^= random_en_passant_col[position.en_passant_target.col()];
+        value ^= zobrist_keys.board[i][*position.mailbox[i]];
     }
-    value ^= (*position.active_player * random_black_to_move);
+    value ^= castling_key(position.castling);
+    value ^= en_passant_key(position.en_passant_target);
+    value ^= (*position.active_player * zobrist_keys.black_to_move);
 
     return value;
 }
 
+i16 piece_square_score(const Position& position)
+{
+    i16 score = 0;
+
+    for (int location = 0; location < 64; ++location) {
+        const auto square = position.mailbox[location];
+        i16 piece_value = nominal_value[*square] + piece_evaluation_tables[*square][location];
+        if (is_black(square)) piece_value = -piece_value;
+        score += piece_value;
+    }
+
+    return score;
+}
+
 }  // namespace Chess
 
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "chess/evaluate.h"
+#include "chess/span.h"
+#include "move_picker.h"
+#include "thread_pool.h"
+
+#include <vector>
+
+namespace Chess {
+
+/**
+ * Runs a search with one thread for each of the histories given, which must
+ * be at least one. The first is the main thread, which runs on the calling
+ * thread, and helper i runs on worker i - 1 of the pool. Each history is used
+ * and updated by a single thread.
+ *
+ * This does the work of recommend_moves, and of Engine with threads that
+ * outlive each search.
+ */
+std::vector<Recommendation> run_search(const Io&, const Position&, Transposition_table&,
+                                       const Search_options&, Span<Search_history*> histories,
+                                       Thread_pool& helpers);
+
+}  // namespace Chess
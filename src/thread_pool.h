@@ -0,0 +1,90 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Chess {
+
+/**
+ * A fixed set of threads that live as long as the pool. Each worker runs one
+ * job at a time, given to it by run(), and sleeps between jobs, so jobs start
+ * without the cost of creating a thread.
+ */
+class Thread_pool {
+public:
+    explicit Thread_pool(int size) {
+        for (int i = 0; i < size; ++i) workers_.push_back(std::make_unique<Worker>());
+        for (auto& worker : workers_) {
+            worker->thread = std::thread([&worker = *worker] { worker.loop(); });
+        }
+    }
+
+    ~Thread_pool() {
+        for (auto& worker : workers_) {
+            {
+                std::lock_guard<std::mutex> lock(worker->mutex);
+                worker->shutting_down = true;
+            }
+            worker->wake.notify_one();
+            worker->thread.join();
+        }
+    }
+
+    Thread_pool(const Thread_pool&) = delete;
+    Thread_pool& operator=(const Thread_pool&) = delete;
+
+    int size() const { return int(workers_.size()); }
+
+    /**
+     * Gives a job to a worker, waiting for any job it already has to finish
+     */
+    void run(int i, std::function<void()> job) {
+        Worker& worker = *workers_[i];
+        std::unique_lock<std::mutex> lock(worker.mutex);
+        worker.idle.wait(lock, [&worker] { return !worker.job; });
+        worker.job = std::move(job);
+        lock.unlock();
+        worker.wake.notify_one();
+    }
+
+    /**
+     * Waits for a worker to finish its job, if it has one
+     */
+    void wait(int i) {
+        Worker& worker = *workers_[i];
+        std::unique_lock<std::mutex> lock(worker.mutex);
+        worker.idle.wait(lock, [&worker] { return !worker.job; });
+    }
+private:
+    struct Worker {
+        void loop() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                wake.wait(lock, [this] { return job || shutting_down; });
+                if (shutting_down) return;
+
+                lock.unlock();
+                job();
+                lock.lock();
+
+                job = nullptr;
+                idle.notify_all();
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable wake;  // A job has been given, or the pool is closing
+        std::condition_variable idle;  // The job has finished
+        std::function<void()> job;     // Empty while the worker is idle
+        bool shutting_down = false;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+};
+
+}  // namespace Chess
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "chess/evaluate.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+namespace Chess {
+
+/**
+ * Keeps track of the limits on a search (see Search_options). Rather than a
+ * separate thread watching the clock, the main search thread checks in every
+ * node_check_interval nodes, and between iterations.
+ *
+ * Two times are worked out at the start. The optimum time is what the search
+ * aims to use, and an iteration is only started if it is expected to finish
+ * within it. The maximum time is a hard deadline, at which the search is
+ * stopped even part of the way through an iteration.
+ */
+class Time_manager {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Milliseconds = std::chrono::milliseconds;
+
+    static constexpr u64 node_check_interval = 1024;
+
+    Time_manager(const Search_options& options, Player player)
+        : start_{Clock::now()}, node_limit_{options.nodes}
+    {
+        const int time_left = player == Player::white ? options.wtime : options.btime;
+        const int increment = player == Player::white ? options.winc  : options.binc;
+
+        // Only the clock of the player to move limits the search, and a depth
+        // that isn't positive counts as no limit
+        const bool any_limit = options.nodes || options.movetime || time_left;
+        max_depth_ = options.depth > 0 ? std::min(options.depth, depth_ceiling)
+                   : any_limit ? depth_ceiling : Search_options::default_depth;
+
+        if (options.movetime) {
+            optimum_ = maximum_ = Milliseconds(options.movetime);
+        }
+
+        if (time_left) {
+            // Leave a little time spare for getting the move back to the clock
+            const Clock::duration available =
+                Milliseconds(std::max(time_left - move_overhead, 1));
+            const Clock::duration share =
+                std::min(available / moves_to_go + Milliseconds(increment * 3 / 4), available);
+
+            optimum_ = std::min(optimum_, share);
+            maximum_ = std::min({maximum_, 4 * share, available});
+        }
+    }
+
+    int max_depth() const { return max_depth_; }
+
+    Clock::duration elapsed() const { return Clock::now() - start_; }
+
+    void add_nodes(u64 nodes) { nodes_.fetch_add(nodes, std::memory_order_relaxed); }
+
+    /**
+     * Whether the search must stop now, even in the middle of an iteration
+     */
+    bool limit_reached() const {
+        return (node_limit_ && nodes_.load(std::memory_order_relaxed) >= node_limit_) ||
+               this->elapsed() >= maximum_;
+    }
+
+    /**
+     * Called after each iteration with the time it took. Predicts the time
+     * the next iteration will take from the growth between the last two, and
+     * returns whether it should be started.
+     */
+    bool should_start_iteration(Clock::duration last_iteration) {
+        double growth = default_growth;
+        if (previous_iteration_.count() > 0) {
+            growth = std::clamp(double(last_iteration.count()) / previous_iteration_.count(),
+                                min_growth, max_growth);
+        }
+        previous_iteration_ = last_iteration;
+
+        const auto predicted =
+            std::chrono::duration_cast<Clock::duration>(last_iteration * growth);
+        return !this->limit_reached() && this->elapsed() + predicted <= optimum_;
+    }
+private:
+    static constexpr int depth_ceiling = 64;
+    static constexpr int moves_to_go = 30;
+    static constexpr int move_overhead = 10;
+
+    static constexpr double default_growth = 2.0;
+    static constexpr double min_growth = 1.5;
+    static constexpr double max_growth = 6.0;
+
+    Clock::time_point start_;
+    Clock::duration optimum_ = Clock::duration::max();
+    Clock::duration maximum_ = Clock::duration::max();
+    Clock::duration previous_iteration_ = Clock::duration::zero();
+
+    int max_depth_;
+    u64 node_limit_;
+    std::atomic<u64> nodes_ = 0;
+};
+
+}  // namespace Chess
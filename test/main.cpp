@@ -5,6 +5,10 @@
 #include <string>
 #include <sstream>
 #include <chrono>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <tuple>
 
 #include "chess/chess.h"
 #include "perft.h"
@@ -82,6 +86,25 @@ BOOST_AUTO_TEST_CASE(kiwipete)
     BOOST_CHECK(count_moves(p, 5) == 193690690);
 }
 
+// Made while globals are initialised, before any test runs, so the lookup
+// tables and hash keys must be ready by then
+const auto kiwipete_at_startup =
+    Position::from_fen("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1");
+const auto kiwipete_moves_at_startup = generate_moves(kiwipete_at_startup);
+const auto kiwipete_after_move_at_startup =
+    apply(kiwipete_moves_at_startup[0], kiwipete_at_startup);
+
+BOOST_AUTO_TEST_CASE(moves_during_static_initialisation)
+{
+    BOOST_CHECK(kiwipete_moves_at_startup.size() == 48);
+
+    const auto p = Position::from_fen(
+        "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1");
+    BOOST_CHECK(kiwipete_at_startup.hash == p.hash);
+    BOOST_CHECK(kiwipete_after_move_at_startup.hash == zobrist_hash(kiwipete_after_move_at_startup));
+    BOOST_CHECK(kiwipete_after_move_at_startup.hash == apply(kiwipete_moves_at_startup[0], p).hash);
+}
+
 BOOST_AUTO_TEST_CASE(position_3)
 {
     const auto p = Position::from_fen("8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1");
@@ -186,13 +209,703 @@ BOOST_AUTO_TEST_CASE(nps)
 {
     Position p = Position::from_fen(initial_fen);
 
-    auto a = std::chrono::high_resolution_clock::now();
-    const auto x = count_moves(p, 6);
-    auto b = std::chrono::high_resolution_clock::now();
-    auto time = std::chrono::duration_cast<std::chrono::milliseconds>(b - a).count();
+    for (auto mode : {Perft_mode::copy_make, Perft_mode::make_unmake}) {
+        auto a = std::chrono::high_resolution_clock::now();
+        const auto x = count_moves(p, 6, mode);
+        auto b = std::chrono::high_resolution_clock::now();
+        auto time = std::chrono::duration_cast<std::chrono::milliseconds>(b - a).count();
+
+        std::cout << (mode == Perft_mode::copy_make ? "Copy-make:   " : "Make-unmake: ")
+                  << x << " in " << time << "ms ("
+                  << (1.0 * (double)x) / ((double)time / 1000.0) << " nps)\n";
+    }
+}
+
+BOOST_AUTO_TEST_CASE(perft_scaling)
+{
+    const int max_threads = std::max(int(std::thread::hardware_concurrency()), 1);
+
+    for (auto [fen, ply, expected] :
+         {std::make_tuple(initial_fen, 5, 4865609LL),
+          std::make_tuple("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+                          4, 4085603LL)}) {
+        const auto p = Position::from_fen(fen);
+        double single_thread_time = 0.0;
+
+        // Always try a few threads, to check the counts, even without the cores to speed up
+        for (int threads = 1; threads <= std::max(max_threads, 4); ++threads) {
+            Perft_options options;
+            options.threads = threads;
+
+            auto a = std::chrono::high_resolution_clock::now();
+            BOOST_CHECK(count_moves(p, ply, options) == expected);
+            auto b = std::chrono::high_resolution_clock::now();
+            const double time = std::chrono::duration<double, std::milli>(b - a).count();
+
+            if (threads == 1) single_thread_time = time;
+            std::cout << "Perft " << ply << ", " << threads << " threads: " << time << "ms ("
+                      << single_thread_time / time << "x)\n";
+        }
+
+        for (int split_depth : {0, 1, 3}) {
+            Perft_options options;
+            options.threads = 3;
+            options.split_depth = split_depth;
+            BOOST_CHECK(count_moves(p, ply, options) == expected);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(hashed_perft)
+{
+    for (auto [fen, ply, expected] :
+         {std::make_tuple(initial_fen, 6, 119060324LL),
+          std::make_tuple("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+                          5, 193690690LL),
+          std::make_tuple("r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+                          6, 706045033LL)}) {
+        const auto p = Position::from_fen(fen);
+
+        Perft_table table(22);
+        Perft_options options;
+        options.table = &table;
+
+        auto a = std::chrono::high_resolution_clock::now();
+        BOOST_CHECK(count_moves(p, ply, options) == expected);
+        auto b = std::chrono::high_resolution_clock::now();
+        auto time = std::chrono::duration_cast<std::chrono::milliseconds>(b - a).count();
+
+        std::cout << "Hashed perft " << ply << ": " << time << "ms, " << table.probes()
+                  << " probes, " << 100 * table.hit_rate() << "% hits\n";
+    }
+
+    // Constant replacement in a tiny table must not affect the counts
+    Perft_table table(4);
+    Perft_options options;
+    options.table = &table;
+    BOOST_CHECK(count_moves(Position::from_fen(initial_fen), 5, options) == 4865609);
+}
+
+bool same_position(const Position& a, const Position& b)
+{
+    return a.mailbox == b.mailbox &&
+           std::equal(std::begin(a.bitboard_by_square), std::end(a.bitboard_by_square),
+                      std::begin(b.bitboard_by_square)) &&
+           std::equal(std::begin(a.bitboard_by_player), std::end(a.bitboard_by_player),
+                      std::begin(b.bitboard_by_player)) &&
+           a.castling[0] == b.castling[0] && a.castling[1] == b.castling[1] &&
+           a.en_passant_target == b.en_passant_target && a.active_player == b.active_player &&
+           a.halfmove_clock == b.halfmove_clock && a.fullmove_number == b.fullmove_number &&
+           a.hash == b.hash && a.score == b.score;
+}
+
+bool make_unmake_matches_apply(Position& position, int ply)
+{
+    if (ply < 1) return true;
+
+    for (auto move : generate_moves(position)) {
+        const auto original = position;
+        const auto expected = apply(move, position);
+
+        const auto undo = make_move(position, move);
+        if (!same_position(position, expected)) return false;
+        if (position.hash != zobrist_hash(position)) return false;
+        if (position.score != piece_square_score(position)) return false;
+        if (!make_unmake_matches_apply(position, ply - 1)) return false;
+        unmake_move(position, move, undo);
+        if (!same_position(position, original)) return false;
+    }
+
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(make_unmake)
+{
+    for (auto fen : {initial_fen,
+                     "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+                     "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+                     "8/8/1k6/2b5/2pP4/8/5K2/8 b - d3 0 1"}) {
+        auto p = Position::from_fen(fen);
+        BOOST_CHECK(make_unmake_matches_apply(p, 3));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(incremental_score)
+{
+    // Every position two plies from kiwipete
+    const auto root = Position::from_fen(
+        "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1");
+    for (auto move : generate_moves(root)) {
+        const auto child = apply(move, root);
+        BOOST_CHECK(child.score == piece_square_score(child));
+        for (auto reply : generate_moves(child)) {
+            const auto grandchild = apply(reply, child);
+            BOOST_CHECK(grandchild.score == piece_square_score(grandchild));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(null_move)
+{
+    auto p = Position::from_fen("8/8/1k6/2b5/2pP4/8/5K2/8 b - d3 0 1");
+    const auto original = p;
+
+    const auto undo = make_null_move(p);
+    BOOST_CHECK(p.active_player == Player::white);
+    BOOST_CHECK(p.en_passant_target == "a1");
+    BOOST_CHECK(p.hash == zobrist_hash(p));
+    BOOST_CHECK(!in_check(p));
+
+    unmake_null_move(p, undo);
+    BOOST_CHECK(same_position(p, original));
+}
+
+bool captures_and_quiets_match_moves(Position& position, int ply)
+{
+    const auto moves = generate_moves(position);
+    const auto captures = generate_captures(position);
+    const auto quiets = generate_quiet_moves(position);
+
+    Move_list expected;
+    for (auto move : moves) {
+        if (is_capture(move.info()) || is_promotion(move.info())) expected.push_back(move);
+    }
+
+    if (captures.size() != expected.size()) return false;
+    for (auto move : expected) {
+        if (std::find(captures.begin(), captures.end(), move) == captures.end()) return false;
+    }
+
+    if (captures.size() + quiets.size() != moves.size()) return false;
+    for (auto move : quiets) {
+        if (std::find(moves.begin(), moves.end(), move) == moves.end()) return false;
+    }
+
+    if (ply <= 1) return true;
+
+    for (auto move : moves) {
+        const auto undo = make_move(position, move);
+        const bool ok = captures_and_quiets_match_moves(position, ply - 1);
+        unmake_move(position, move, undo);
+        if (!ok) return false;
+    }
+
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(staged_generation)
+{
+    for (auto fen : {"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+                     "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+                     "8/8/1k6/2b5/2pP4/8/5K2/8 b - d3 0 1",
+                     "2K2r2/4P3/8/8/8/8/8/3k4 w - - 0 1"}) {
+        auto p = Position::from_fen(fen);
+        BOOST_CHECK(captures_and_quiets_match_moves(p, 3));
+    }
+}
+
+bool counts_match_moves(Position& position, int ply)
+{
+    const auto moves = generate_moves(position);
+    if (count_legal_moves(position) != int(moves.size())) return false;
+
+    if (ply <= 1) return true;
+
+    for (auto move : moves) {
+        const auto undo = make_move(position, move);
+        const bool ok = counts_match_moves(position, ply - 1);
+        unmake_move(position, move, undo);
+        if (!ok) return false;
+    }
+
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(legal_move_count)
+{
+    for (auto fen : {"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+                     "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+                     "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+                     "8/8/1k6/2b5/2pP4/8/5K2/8 b - d3 0 1",
+                     "2K2r2/4P3/8/8/8/8/8/3k4 w - - 0 1"}) {
+        auto p = Position::from_fen(fen);
+        BOOST_CHECK(counts_match_moves(p, 3));
+    }
+}
+
+/**
+ * Goes through every possible encoding of a move, and checks that those which
+ * are pseudo-legal and don't leave the mover in check are exactly the legal ones
+ */
+bool pseudo_legal_moves_match_legal(Position& position)
+{
+    const auto legal = generate_moves(position);
+    int num_legal = 0;
+
+    for (int from = 0; from < 64; ++from) {
+        for (int to = 0; to < 64; ++to) {
+            for (int info = 0; info < 16; ++info) {
+                const Move move{Location(u8(from)), Location(u8(to)), Move::Info(info)};
+                if (!move || !is_pseudo_legal_move(move, position)) continue;
+
+                const Player player = position.active_player;
+                const auto undo = make_move(position, move);
+                const bool leaves_check = in_check(position, player);
+                unmake_move(position, move, undo);
+                if (leaves_check) continue;
+
+                if (std::find(legal.begin(), legal.end(), move) == legal.end()) return false;
+                ++num_legal;
+            }
+        }
+    }
+
+    return num_legal == int(legal.size());
+}
+
+BOOST_AUTO_TEST_CASE(pseudo_legal_moves)
+{
+    for (auto fen : {"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+                     "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+                     "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+                     "8/8/1k6/2b5/2pP4/8/5K2/8 b - d3 0 1",
+                     "2K2r2/4P3/8/8/8/8/8/3k4 w - - 0 1"}) {
+        auto p = Position::from_fen(fen);
+        BOOST_CHECK(pseudo_legal_moves_match_legal(p));
+        for (auto move : generate_moves(p)) {
+            const auto undo = make_move(p, move);
+            BOOST_CHECK(pseudo_legal_moves_match_legal(p));
+            unmake_move(p, move, undo);
+        }
+    }
+
+    // A table move that would leave the king in check is never played, even
+    // when the table gives it for this very position
+    const auto p = Position::from_fen("4k3/4r3/8/8/8/8/4N3/4K3 w - - 0 1");
+    Transposition_table tt(16);
+    Transposition_node node;
+    node.key = p.hash;
+    node.best_move = Move("e2", "c3");
+    tt.store(node);
+
+    Search_options options;
+    options.depth = 4;
+    const auto [move, score] = recommend_move(p, tt, options);
+    BOOST_CHECK(is_legal_move(move, p));
+}
+
+BOOST_AUTO_TEST_CASE(game_over_scores)
+{
+    Transposition_table tt(16);
+    Search_options options;
+    options.depth = 4;
+
+    // Back rank mate
+    auto p = Position::from_fen("6k1/5ppp/8/8/8/8/8/R5K1 w - - 0 1");
+    auto [move, score] = recommend_move(p, tt, options);
+    BOOST_CHECK(move == Move("a1", "a8", Move::Info::normal));
+    BOOST_CHECK(score > 9000);
+
+    // Already mated
+    p = Position::from_fen("R5k1/5ppp/8/8/8/8/8/6K1 b - - 0 1");
+    BOOST_CHECK(recommend_move(p, tt, options).score < -9000);
+
+    // Stalemated, a queen down
+    p = Position::from_fen("7k/5Q2/6K1/8/8/8/8/8 b - - 0 1");
+    BOOST_CHECK(recommend_move(p, tt, options).score == 0);
+}
+
+BOOST_AUTO_TEST_CASE(mate_distance)
+{
+    // Two rooks mate in five, which takes a few iterations to find, and nodes
+    // from the table are reused at other plies in later iterations
+    const auto p = Position::from_fen("8/8/8/8/3k4/8/8/R3K2R w - - 0 1");
+
+    int mates_reported = 0;
+    Io io;
+    io.report_iteration = [&](int, i16 score, Move_span pv, const Search_stats&) {
+        if (score < 9000) return;
+        ++mates_reported;
+
+        // The score gives the number of plies to mate, which the principal
+        // variation should take exactly, ending in checkmate
+        BOOST_CHECK(int(pv.size()) == 10000 - score);
+        auto end = p;
+        for (auto move : pv) end = apply(move, end);
+        BOOST_CHECK(in_check(end) && generate_moves(end).empty());
+    };
+
+    Transposition_table tt(20);
+    Search_options options;
+    options.depth = 14;
+    recommend_moves(io, p, tt, options);
+    BOOST_CHECK(mates_reported > 0);
+}
+
+BOOST_AUTO_TEST_CASE(static_exchange)
+{
+    // Undefended pawn
+    auto p = Position::from_fen("1k1r4/1pp4p/p7/4p3/8/P5P1/1PP4P/2K1R3 w - - 0 1");
+    BOOST_CHECK(static_exchange_evaluation(p, Move("e1", "e5", Move::Info::normal_capture)) ==
+                100);
+
+    // Knight for a pawn, with x-rays on both sides
+    p = Position::from_fen("1k1r3q/1ppn3p/p4b2/4p3/8/P2N2P1/1PP1R1BP/2K1Q3 w - - 0 1");
+    BOOST_CHECK(static_exchange_evaluation(p, Move("d3", "e5", Move::Info::normal_capture)) ==
+                -200);
+
+    // Pawn takes a defended rook
+    p = Position::from_fen("4k3/4p3/3r4/2P5/8/8/8/4K3 w - - 0 1");
+    BOOST_CHECK(static_exchange_evaluation(p, Move("c5", "d6", Move::Info::normal_capture)) ==
+                400);
+}
+
+BOOST_AUTO_TEST_CASE(hash_transposition)
+{
+    auto p = Position::from_fen(initial_fen);
+    const auto initial_hash = p.hash;
+
+    p = apply(deduce_move_from_coordinates(p, "g1", "f3"), p);
+    p = apply(deduce_move_from_coordinates(p, "g8", "f6"), p);
+    BOOST_CHECK(p.hash != initial_hash);
+    p = apply(deduce_move_from_coordinates(p, "f3", "g1"), p);
+    p = apply(deduce_move_from_coordinates(p, "f6", "g8"), p);
+    BOOST_CHECK(p.hash == initial_hash);
+    BOOST_CHECK(p.hash == zobrist_hash(p));
+}
+
+BOOST_AUTO_TEST_CASE(transposition_table_replacement)
+{
+    // A table with a single cluster
+    Transposition_table tt(2);
+
+    Transposition_node deep;
+    deep.key = 1;
+    deep.depth = 10;
+    tt.store(deep);
+
+    for (u64 key = 2; key < 10; ++key) {
+        Transposition_node shallow;
+        shallow.key = key;
+        shallow.depth = 1;
+        tt.store(shallow);
+    }
+
+    BOOST_CHECK(tt.probe(1));
+    BOOST_CHECK(tt.probe(1).depth == 10);
+    BOOST_CHECK(tt.probe(9));
+
+    // Once the deep node is old enough, it should be replaced
+    tt.new_search();
+    tt.new_search();
+    for (u64 key = 10; key < 14; ++key) {
+        Transposition_node shallow;
+        shallow.key = key;
+        shallow.depth = 1;
+        tt.store(shallow);
+    }
+
+    BOOST_CHECK(!tt.probe(1));
+
+    // The generation wraps after 256 searches, and a node stored just before the
+    // wrap should still count as older than those stored just after it
+    Transposition_table wrapping(2);
+    for (int i = 0; i < 255; ++i) wrapping.new_search();
+    wrapping.store(deep);
+    wrapping.new_search();
+    wrapping.new_search();
+    for (u64 key = 2; key < 6; ++key) {
+        Transposition_node shallow;
+        shallow.key = key;
+        shallow.depth = 1;
+        wrapping.store(shallow);
+    }
+
+    BOOST_CHECK(!wrapping.probe(1));
+    BOOST_CHECK(wrapping.probe(5));
+
+    // Smaller sizes still give a single cluster
+    Transposition_table tiny(0);
+    tiny.store(deep);
+    BOOST_CHECK(tiny.probe(1).depth == 10);
+}
+
+/**
+ * Build a node whose contents are entirely determined by its key, so that a
+ * node made of parts of two different writes can be recognised
+ */
+Transposition_node node_from_key(u64 key)
+{
+    Transposition_node node;
+    node.key = key;
+    node.best_move = Move(u8(key % 64), u8((key >> 6) % 64), Move::Info(key >> 12 & 0x0F));
+    node.score = i16(key >> 16);
+    node.depth = u8(key >> 40);
+    node.type = Node_type((key >> 48) % 3);
+    return node;
+}
+
+BOOST_AUTO_TEST_CASE(transposition_table_concurrency)
+{
+    // A small table, so that threads are constantly overwriting each other
+    Transposition_table tt(4);
+
+    constexpr int num_threads = 8;
+    constexpr int iterations = 200000;
+
+    std::atomic<int> bad_nodes = 0;
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&tt, &bad_nodes, t] {
+            std::mt19937_64 gen(t);
+            for (int i = 0; i < iterations; ++i) {
+                // Only use a few keys, so that probes often find something
+                const u64 key = (gen() % 64) * 0x9E3779B97F4A7C15 | 1;
+                if (gen() % 2) {
+                    tt.store(node_from_key(key));
+                } else if (const auto node = tt.probe(key)) {
+                    const auto expected = node_from_key(key);
+                    if (!(node.best_move == expected.best_move) ||
+                        node.score != expected.score ||
+                        node.depth != expected.depth || node.type != expected.type)
+                    {
+                        ++bad_nodes;
+                    }
+                }
+            }
+        });
+    }
+
+    for (auto& thread : threads) thread.join();
+
+    BOOST_CHECK(bad_nodes == 0);
+}
+
+BOOST_AUTO_TEST_CASE(multithreaded_search)
+{
+    const auto p = Position::from_fen("4k3/8/8/3q4/8/8/8/3QK3 w - - 0 1");
+
+    Transposition_table tt(16);
+    Search_options options;
+    options.threads = 4;
+    const auto [move, score] = recommend_move(p, tt, options);
 
-    std::cout << x << " in " << time << "ms (" << (1.0 * (double)x) / ((double)time / 1000.0)
-              << " nps)\n";
+    BOOST_CHECK(move == Move("d1", "d5", Move::Info::normal_capture));
+    BOOST_CHECK(score > 500);
+}
+
+BOOST_AUTO_TEST_CASE(search_limits)
+{
+    using namespace std::chrono;
+
+    const auto p = Position::from_fen(
+        "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1");
+
+    // What a search reached: the time it took, and the depth and node count
+    // of the last iteration it completed
+    struct Reached {
+        long long ms = 0;
+        int depth = 0;
+        u64 nodes = 0;
+    };
+
+    const auto timed_search = [&p](const Search_options& options) {
+        Transposition_table tt(16);
+        Reached reached;
+
+        Io io;
+        io.report_iteration = [&reached](int depth, i16, Move_span, const Search_stats& stats) {
+            reached.depth = depth;
+            reached.nodes = stats.nodes;
+        };
+
+        const auto start = steady_clock::now();
+        const auto recommendations = recommend_moves(io, p, tt, options);
+        reached.ms = duration_cast<milliseconds>(steady_clock::now() - start).count();
+
+        BOOST_REQUIRE(recommendations.size() == 1);
+        BOOST_CHECK(is_legal_move(recommendations[0].move, p));
+        return reached;
+    };
+
+    Search_options options;
+    options.depth = 3;
+    BOOST_CHECK(timed_search(options).depth == 3);
+
+    // The default depth takes far more than this many nodes, so the search is
+    // stopped part of the way through an iteration
+    options = {};
+    options.nodes = 10000;
+    auto reached = timed_search(options);
+    BOOST_CHECK(reached.depth < Search_options::default_depth);
+    BOOST_CHECK(reached.nodes > 0 && reached.nodes <= 10000);
+
+    options = {};
+    options.movetime = 200;
+    BOOST_CHECK(timed_search(options).ms < 300);
+
+    // Only black's clock is running low, but it is white to move. White aims
+    // to use about a thirtieth of the time left plus most of the increment,
+    // and never more than four times that.
+    for (const int winc : {0, 100}) {
+        options = {};
+        options.wtime = 3000;
+        options.winc = winc;
+        options.btime = 10;
+        const long long share = (3000 - 10) / 30 + winc * 3 / 4;
+        reached = timed_search(options);
+        BOOST_CHECK(reached.depth > 0);
+        BOOST_CHECK(reached.ms < 4 * share + 50);
+    }
+
+    // Only black has a clock, so white searches to the default depth
+    options = {};
+    options.btime = 3000;
+    BOOST_CHECK(timed_search(options).depth == Search_options::default_depth);
+
+    options = {};
+    options.depth = -1;
+    BOOST_CHECK(timed_search(options).depth == Search_options::default_depth);
+}
+
+BOOST_AUTO_TEST_CASE(iteration_reports)
+{
+    const auto p = Position::from_fen(initial_fen);
+
+    std::vector<Search_stats> reports;
+    Move_list last_pv;
+    Move best_move;
+
+    Io io;
+    io.report_best_move = [&best_move](Move move) { best_move = move; };
+    io.report_iteration = [&](int depth, i16, Move_span pv, const Search_stats& stats) {
+        BOOST_CHECK(depth == stats.depth);
+        reports.push_back(stats);
+
+        last_pv = {};
+        for (auto move : pv) last_pv.push_back(move);
+    };
+
+    Transposition_table tt(16);
+    Search_options options;
+    options.depth = 5;
+    options.threads = 2;
+    recommend_move(io, p, tt, options);
+
+    BOOST_REQUIRE(reports.size() == 5);
+    for (std::size_t i = 0; i < reports.size(); ++i) {
+        const auto& stats = reports[i];
+        BOOST_CHECK(stats.depth == int(i) + 1);
+        BOOST_CHECK(stats.seldepth >= stats.depth);
+        BOOST_CHECK(stats.qnodes < stats.nodes);
+        BOOST_CHECK(stats.tt_hits <= stats.tt_probes);
+        BOOST_CHECK(stats.first_move_cutoffs <= stats.beta_cutoffs);
+        if (i > 0) BOOST_CHECK(stats.nodes > reports[i - 1].nodes);
+    }
+
+    // The principal variation starts with the move played, and is a legal line
+    BOOST_REQUIRE(!last_pv.empty());
+    BOOST_CHECK(last_pv.front() == best_move);
+    auto position = p;
+    for (auto move : last_pv) {
+        BOOST_REQUIRE(is_legal_move(move, position));
+        position = apply(move, position);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(multipv)
+{
+    auto p = Position::from_fen(
+        "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1");
+
+    Move best_move;
+    Io io;
+    io.report_best_move = [&best_move](Move move) { best_move = move; };
+
+    Transposition_table tt(16);
+    Search_options options;
+    options.depth = 5;
+    options.multipv = 4;
+    auto recommendations = recommend_moves(io, p, tt, options);
+
+    BOOST_REQUIRE(recommendations.size() == 4);
+    BOOST_CHECK(recommendations[0].move == best_move);
+    for (std::size_t i = 0; i < recommendations.size(); ++i) {
+        BOOST_CHECK(is_legal_move(recommendations[i].move, p));
+        for (std::size_t j = 0; j < i; ++j) {
+            BOOST_CHECK(!(recommendations[i].move == recommendations[j].move));
+            BOOST_CHECK(recommendations[i].score <= recommendations[j].score);
+        }
+    }
+
+    // The king has only three moves
+    p = Position::from_fen("4k3/8/8/8/8/8/8/r3K3 w - - 0 1");
+    options.multipv = 5;
+    recommendations = recommend_moves(p, tt, options);
+    BOOST_CHECK(recommendations.size() == 3);
+}
+
+BOOST_AUTO_TEST_CASE(batch_analysis)
+{
+    const std::vector<Position> positions = {
+        Position::from_fen(initial_fen),
+        Position::from_fen("4k3/8/8/3q4/8/8/8/3QK3 w - - 0 1"),
+        Position::from_fen("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1"),
+        Position::from_fen("8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1"),
+        Position::from_fen("rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8"),
+    };
+
+    Batch_analyser analyser(3, 12);
+    BOOST_CHECK(analyser.workers() == 3);
+
+    Search_options options;
+    options.depth = 4;
+
+    // The pool is reused for the second batch
+    for (int batch = 0; batch < 2; ++batch) {
+        const auto recommendations = analyser.analyse(positions, options);
+
+        BOOST_REQUIRE(recommendations.size() == positions.size());
+        for (std::size_t i = 0; i < positions.size(); ++i) {
+            BOOST_CHECK(is_legal_move(recommendations[i].move, positions[i]));
+        }
+        BOOST_CHECK(recommendations[1].move == Move("d1", "d5", Move::Info::normal_capture));
+
+        BOOST_CHECK(analyser.stats().positions == positions.size());
+        BOOST_CHECK(analyser.stats().nodes > 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(engine)
+{
+    Engine engine(2, 16);
+    BOOST_CHECK(engine.threads() == 2);
+
+    Search_options options;
+    options.depth = 5;
+
+    // Play a few moves of a game, reusing the engine's state
+    auto p = Position::from_fen(initial_fen);
+    for (int ply = 0; ply < 6; ++ply) {
+        const auto recommendations = engine.search(p, options);
+        BOOST_REQUIRE(recommendations.size() == 1);
+        BOOST_REQUIRE(is_legal_move(recommendations[0].move, p));
+        p = apply(recommendations[0].move, p);
+    }
+
+    // A search too deep to finish can be stopped, and still gives a move
+    Io io;
+    options.depth = 60;
+    engine.go(io, p, options);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    const auto recommendations = engine.stop();
+    BOOST_REQUIRE(recommendations.size() == 1);
+    BOOST_CHECK(is_legal_move(recommendations[0].move, p));
+
+    engine.clear();
+    options.depth = 3;
+    BOOST_CHECK(is_legal_move(engine.search(p, options)[0].move, p));
 }
 
 BOOST_AUTO_TEST_CASE(deduce_move)
@@ -3,67 +3,326 @@
 #include "chess/generate_moves.h"
 #include <iostream>
 #include <algorithm>
-#include <numeric>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <thread>
 #include <vector>
-#include <array>
+#include <cassert>
 
-inline long long count_moves_single(const Chess::Position& position, int ply)
+// Compile the tests with -DVERIFY_INCREMENTAL to check that the incrementally
+// updated hash and score agree with a full recomputation at every node visited
+// by perft
+#ifdef VERIFY_INCREMENTAL
+#define ASSERT_CONSISTENT(position)                        \
+    assert(position.hash == Chess::zobrist_hash(position) && \
+           position.score == Chess::piece_square_score(position))
+#else
+#define ASSERT_CONSISTENT(position)
+#endif
+
+/**
+ * Perft can either copy the position at every node (copy-make), or make and
+ * unmake moves on a single position (make-unmake). Both are kept so that they
+ * can be benchmarked against each other.
+ */
+enum class Perft_mode {
+    copy_make,
+    make_unmake,
+};
+
+inline long long count_moves_copy_make(const Chess::Position& position, int ply)
 {
+    ASSERT_CONSISTENT(position);
+
     if (ply < 1) return 1;
+    if (ply == 1) return Chess::count_legal_moves(position);
 
     long long counter = 0;
 
     const auto moves = Chess::generate_moves(position);
 
-    if (ply == 1) return moves.size();
-
     for (auto move : moves) {
         const auto new_position = apply(move, position);
-        counter += count_moves_single(new_position, ply - 1);
+        counter += count_moves_copy_make(new_position, ply - 1);
     }
 
     return counter;
 }
 
-inline long long count_moves(const Chess::Position& position, int ply)
+inline long long count_moves_make_unmake(Chess::Position& position, int ply)
 {
+    ASSERT_CONSISTENT(position);
+
     if (ply < 1) return 1;
+    if (ply == 1) return Chess::count_legal_moves(position);
+
+    long long counter = 0;
 
     const auto moves = Chess::generate_moves(position);
 
-    if (ply == 1) return moves.size();
+    for (auto move : moves) {
+        const auto undo = Chess::make_move(position, move);
+        counter += count_moves_make_unmake(position, ply - 1);
+        Chess::unmake_move(position, move, undo);
+    }
+
+    return counter;
+}
 
-    constexpr int num_threads = 1;
+inline long long count_moves_single(const Chess::Position& position, int ply,
+                                    Perft_mode mode = Perft_mode::make_unmake)
+{
+    if (mode == Perft_mode::copy_make) return count_moves_copy_make(position, ply);
 
-    const auto f = [&position, ply](auto begin, auto end, long long& counter) {
-        for (auto it = begin; it != end; ++it) {
-            const auto& move = *it;
-            const auto new_position = apply(move, position);
-            counter += count_moves_single(new_position, ply - 1);
-        }
-        return counter;
+    auto copy = position;
+    return count_moves_make_unmake(copy, ply);
+}
+
+/**
+ * A table of perft results: the number of nodes found a given number of plies
+ * below a position. Like the search's transposition table, it may be used by
+ * several threads at once without locking. Each entry is two atomic words,
+ * the data and the key XORed with the data, so an entry torn by two threads
+ * writing at once fails to match any key. The full key is checked, so a count
+ * is only ever wrong if two positions share a 64 bit hash.
+ *
+ * Each position and ply has one place in the table, and new entries always
+ * replace old ones.
+ */
+class Perft_table {
+public:
+    // The table holds 2^log_size entries of 16 bytes
+    explicit Perft_table(int log_size)
+        : entries_(std::size_t(1) << log_size), mask_{(Chess::u64(1) << log_size) - 1}
+    {}
+
+    bool probe(Chess::u64 key, int ply, long long& count) const {
+        const Entry& entry = this->entry_for(key, ply);
+        const Chess::u64 data = entry.data.load(std::memory_order_relaxed);
+        const Chess::u64 key_xor_data = entry.key_xor_data.load(std::memory_order_relaxed);
+        if ((key_xor_data ^ data) != key || int(data & 0xFF) != ply) return false;
+        count = (long long)(data >> 8);
+        return true;
+    }
+
+    void store(Chess::u64 key, int ply, long long count) {
+        Entry& entry = this->entry_for(key, ply);
+        const Chess::u64 data = (Chess::u64(count) << 8) | Chess::u64(ply);
+        entry.key_xor_data.store(key ^ data, std::memory_order_relaxed);
+        entry.data.store(data, std::memory_order_relaxed);
+    }
+
+    // Counts are kept by each thread, and added here when it finishes a task
+    void add_stats(Chess::u64 probes, Chess::u64 hits) {
+        probes_ += probes;
+        hits_ += hits;
+    }
+
+    Chess::u64 probes() const { return probes_; }
+    Chess::u64 hits() const { return hits_; }
+    double hit_rate() const { return probes_ ? double(hits_) / probes_ : 0.0; }
+private:
+    struct Entry {
+        std::atomic<Chess::u64> key_xor_data{0};
+        std::atomic<Chess::u64> data{0};  // The count, shifted up 8 bits, and the ply
     };
 
-    auto block_size = moves.size() / num_threads;
-    std::array<long long, num_threads> counters{};
-    std::array<std::thread, num_threads - 1> threads;
+    // The same position at different plies goes in different places
+    Entry& entry_for(Chess::u64 key, int ply) {
+        return entries_[(key ^ (Chess::u64(ply) * 0x9E3779B97F4A7C15)) & mask_];
+    }
+    const Entry& entry_for(Chess::u64 key, int ply) const {
+        return entries_[(key ^ (Chess::u64(ply) * 0x9E3779B97F4A7C15)) & mask_];
+    }
+
+    std::vector<Entry> entries_;
+    Chess::u64 mask_;
+    std::atomic<Chess::u64> probes_ = 0;
+    std::atomic<Chess::u64> hits_ = 0;
+};
 
-    auto block_begin = moves.begin();
-    for (int i = 0; i < num_threads - 1; ++i) {
-        auto block_end = block_begin;
-        std::advance(block_end, block_size);
-        threads[i] = std::thread(f, block_begin, block_end, std::ref(counters[i]));
-        block_begin = block_end;
+/**
+ * Make-unmake perft that looks up and stores the count for every node of two
+ * or more plies in the table. probes and hits are incremented as it goes.
+ */
+inline long long count_moves_hashed(Chess::Position& position, int ply, Perft_table& table,
+                                    Chess::u64& probes, Chess::u64& hits)
+{
+    ASSERT_CONSISTENT(position);
+
+    if (ply < 1) return 1;
+    if (ply == 1) return Chess::count_legal_moves(position);
+
+    long long counter = 0;
+
+    ++probes;
+    if (table.probe(position.hash, ply, counter)) {
+        ++hits;
+        return counter;
     }
 
-    f(block_begin, moves.end(), counters.back());
+    const auto moves = Chess::generate_moves(position);
 
-    for (auto& thread : threads) {
-        thread.join();   
+    for (auto move : moves) {
+        const auto undo = Chess::make_move(position, move);
+        counter += count_moves_hashed(position, ply - 1, table, probes, hits);
+        Chess::unmake_move(position, move, undo);
     }
 
-    return std::accumulate(counters.begin(), counters.end(), 0LL);
+    table.store(position.hash, ply, counter);
+
+    return counter;
+}
+
+struct Perft_options {
+    // Defaults to one thread for each hardware thread
+    int threads = std::max(int(std::thread::hardware_concurrency()), 1);
+
+    // Nodes this many plies below the root or fewer are split into a task for
+    // each of their moves, and deeper nodes are counted within a single task
+    int split_depth = 2;
+
+    Perft_mode mode = Perft_mode::make_unmake;
+
+    // If given, counts are cached in the table (and mode is ignored)
+    Perft_table* table = nullptr;
+};
+
+/**
+ * Perft tasks for one thread. The owning thread pushes and pops tasks at the
+ * back, working depth first, while idle threads steal from the front, where
+ * the tasks nearest the root (and so usually the largest) are found.
+ */
+class Perft_deque {
+public:
+    struct Task {
+        Chess::Position position;
+        int ply;    // Plies left to count
+        int depth;  // Plies below the root
+    };
+
+    void push(Task task) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(std::move(task));
+    }
+
+    bool pop(Task& task) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (tasks_.empty()) return false;
+        task = std::move(tasks_.back());
+        tasks_.pop_back();
+        return true;
+    }
+
+    bool steal(Task& task) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (tasks_.empty()) return false;
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+        return true;
+    }
+private:
+    std::mutex mutex_;
+    std::deque<Task> tasks_;
+};
+
+/**
+ * Parallel perft. The tree is split into tasks down to options.split_depth,
+ * so that work can be shared out evenly, even though the subtrees of
+ * different moves can be of very different sizes. Each thread has its own
+ * deque of tasks, and steals from the others when it runs out. A thread that
+ * finds nothing to steal sleeps until more tasks are queued, rather than
+ * taking time from the threads with work.
+ *
+ * Tasks are only made down to split_depth, so there are a few hundred of them
+ * in a perft, and a lock for each push, pop and steal costs nothing measurable.
+ */
+inline long long count_moves(const Chess::Position& position, int ply,
+                             const Perft_options& options)
+{
+    if (ply < 1) return 1;
+
+    const int num_threads = std::max(options.threads, 1);
+
+    std::vector<Perft_deque> deques(num_threads);
+    deques[0].push({position, ply, 0});
+
+    // Tasks not yet finished, including those waiting in deques
+    std::atomic<long long> pending = 1;
+    // Tasks waiting in deques
+    std::atomic<long long> queued = 1;
+    std::atomic<long long> total = 0;
+
+    // Idle threads wait here for queued tasks, or for the count to finish. The
+    // counters are changed outside the lock, so it is taken before notifying,
+    // to make sure a thread that has just seen the old values is waiting.
+    std::mutex idle_mutex;
+    std::condition_variable idle;
+    const auto wake_idle = [&] {
+        { std::lock_guard<std::mutex> lock(idle_mutex); }
+        idle.notify_all();
+    };
+
+    const auto work = [&](int id) {
+        long long counter = 0;
+        Perft_deque::Task task;
+
+        while (true) {
+            bool found = deques[id].pop(task);
+            for (int i = 1; !found && i < num_threads; ++i) {
+                found = deques[(id + i) % num_threads].steal(task);
+            }
+            if (!found) {
+                std::unique_lock<std::mutex> lock(idle_mutex);
+                idle.wait(lock, [&] { return queued > 0 || pending == 0; });
+                if (pending == 0) break;
+                continue;
+            }
+            --queued;
+
+            if (task.depth < options.split_depth && task.ply > 1) {
+                const auto moves = Chess::generate_moves(task.position);
+                pending += moves.size();
+                for (auto move : moves) {
+                    deques[id].push({apply(move, task.position), task.ply - 1, task.depth + 1});
+                }
+                queued += moves.size();
+                if (num_threads > 1) wake_idle();
+            } else if (options.table) {
+                Chess::u64 probes = 0;
+                Chess::u64 hits = 0;
+                counter += count_moves_hashed(task.position, task.ply, *options.table, probes,
+                                              hits);
+                options.table->add_stats(probes, hits);
+            } else {
+                counter += count_moves_single(task.position, task.ply, options.mode);
+            }
+
+            if (--pending == 0) wake_idle();
+        }
+
+        total += counter;
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < num_threads; ++i) threads.emplace_back(work, i);
+    work(0);
+    for (auto& thread : threads) thread.join();
+
+    return total;
+}
+
+inline long long count_moves(const Chess::Position& position, int ply,
+                             Perft_mode mode = Perft_mode::make_unmake)
+{
+    // Runs on one thread, so that timings and divide() aren't affected by
+    // the number of cores
+    Perft_options options;
+    options.threads = 1;
+    options.mode = mode;
+    return count_moves(position, ply, options);
 }
 
 inline void divide(const Chess::Position& position, int ply)